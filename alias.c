@@ -25,79 +25,351 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fnmatch.h>
+#include <fcntl.h>
 #include "init.h"
 
 #define ALIASFILE	"modules.alias"
 #define CHECK_LEN	1024
 #define SYS_PATH	"/sys/devices"
-#define LINELENGTH	8000
 
-/* find_modalias search /sys/devices (SYS_PATH) for all present modalias files
- * and store the contents of all found modalias files in the mod_list linked 
- * list */
+/* modalias collector
+ *
+ * /sys/devices (SYS_PATH) is walked with openat() and d_type, the
+ * contents of all modalias files are read into one arena and identical
+ * modaliases are stored once. The result is kept for the whole boot: a
+ * later scan still lists the directories, but only reads the modalias of
+ * devices (directories, by inode) which were not seen before. Every
+ * modalias remembers which alias buses it was already matched against. */
 
-static int find_modalias (struct mod_list **list, const char *path)
+#define MODALIAS_HASH_SIZE	1024	/* power of 2 */
+#define MODALIAS_READ_MAX	4096
+
+struct modalias_entry {
+	size_t			offset;		/* modalias string in the arena */
+	unsigned int		done;		/* bit mask of matched alias buses */
+	int			next;		/* next entry in hash slot, -1 = end */
+};
+
+struct modalias_cache {
+	char			*arena;
+	size_t			used;
+	size_t			size;
+	struct modalias_entry	*entries;
+	int			count;
+	int			max;
+	int			hash[MODALIAS_HASH_SIZE];
+	ino_t			*dirs;		/* open addressing set of seen devices */
+	size_t			dirs_count;
+	size_t			dirs_size;	/* power of 2 */
+};
+
+static struct modalias_cache *modalias_cache = NULL;
+
+/* module name index and modules.alias index, freed by alias_release() */
+static struct arena alias_arena;
+
+static struct modalias_cache *modalias_cache_get (void)
 {
-	struct dirent *dirent;
-	struct mod_list *entry = NULL;
-	DIR *dir = opendir(path);
-	FILE *f = NULL;
-	char line[512], name[PATH_MAX];
-	struct stat st;
 	int i;
 
-	while ((dirent = readdir(dir))) 
-	{
-		if (dirent->d_name[0] == '.')
-			continue;
+	if (modalias_cache == NULL) {
+		modalias_cache = calloc(1, sizeof(struct modalias_cache));
+		if (modalias_cache == NULL)
+			return NULL;
+		for (i = 0; i < MODALIAS_HASH_SIZE; i++)
+			modalias_cache->hash[i] = -1;
+	}
 
-		snprintf(name, sizeof (name), "%s/%s", path, dirent->d_name);
-		if (lstat(name, &st))
+	return modalias_cache;
+}
+
+/* add a directory inode to the set of seen devices, returns 1 if it
+ * was already there */
+
+static int modalias_dir_seen (struct modalias_cache *c, ino_t ino)
+{
+	ino_t *dirs, slot;
+	size_t i, n;
+
+	if (c->dirs_count * 2 >= c->dirs_size) {
+		n = c->dirs_size ? c->dirs_size * 2 : 1024;
+		dirs = calloc(n, sizeof(ino_t));
+		if (dirs == NULL)
+			return 0;
+		for (i = 0; i < c->dirs_size; i++) {
+			if (c->dirs[i] == 0)
+				continue;
+			slot = c->dirs[i] & (n - 1);
+			while (dirs[slot] != 0)
+				slot = (slot + 1) & (n - 1);
+			dirs[slot] = c->dirs[i];
+		}
+		free(c->dirs);
+		c->dirs = dirs;
+		c->dirs_size = n;
+	}
+
+	/* inode 0 marks a free slot */
+	if (ino == 0)
+		return 0;
+
+	for (i = ino & (c->dirs_size - 1); c->dirs[i] != 0; i = (i + 1) & (c->dirs_size - 1)) {
+		if (c->dirs[i] == ino)
+			return 1;
+	}
+	c->dirs[i] = ino;
+	c->dirs_count++;
+
+	return 0;
+}
+
+/* add the modalias at the end of the arena (len bytes, not terminated),
+ * drops it again if it is already known */
+
+static struct modalias_entry *modalias_add (struct modalias_cache *c, size_t len)
+{
+	struct modalias_entry *entries;
+	char *alias = c->arena + c->used;
+	unsigned int slot;
+	int i;
+
+	alias[len] = '\0';
+	slot = hash_string(alias, len) & (MODALIAS_HASH_SIZE - 1);
+	for (i = c->hash[slot]; i >= 0; i = c->entries[i].next) {
+		if (strcmp(c->arena + c->entries[i].offset, alias) == 0)
+			return &c->entries[i];
+	}
+
+	if (c->count == c->max) {
+		entries = realloc(c->entries, (c->max + 256) * sizeof(struct modalias_entry));
+		if (entries == NULL)
+			return NULL;
+		c->entries = entries;
+		c->max += 256;
+	}
+
+	c->entries[c->count].offset = c->used;
+	c->entries[c->count].done = 0;
+	c->entries[c->count].next = c->hash[slot];
+	c->hash[slot] = c->count;
+	c->used += len + 1;
+
+	return &c->entries[c->count++];
+}
+
+static int modalias_reserve (struct modalias_cache *c, size_t len)
+{
+	char *arena;
+	size_t n;
+
+	if (c->used + len <= c->size)
+		return 0;
+
+	n = c->size ? c->size : 16384;
+	while (c->used + len > n)
+		n *= 2;
+	arena = realloc(c->arena, n);
+	if (arena == NULL)
+		return -1;
+	c->arena = arena;
+	c->size = n;
+
+	return 0;
+}
+
+/* read a modalias attribute with a single read, one modalias per line */
+
+static void modalias_read (struct modalias_cache *c, int dfd)
+{
+	char *p, *line, *end;
+	ssize_t len;
+	int fd;
+
+	fd = openat(dfd, "modalias", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (modalias_reserve(c, MODALIAS_READ_MAX + 1) != 0) {
+		close(fd);
+		return;
+	}
+	len = read(fd, c->arena + c->used, MODALIAS_READ_MAX);
+	close(fd);
+	if (len <= 0)
+		return;
+
+	/* move every line to the arena end and add it, the lines of the
+	   buffer just read are consumed from the front */
+	p = c->arena + c->used;
+	end = p + len;
+	*end = '\0';
+	for (line = p; line < end; line = p + 1) {
+		p = memchr(line, '\n', end - line);
+		if (p == NULL)
+			p = end;
+		if (p == line)
 			continue;
+		memmove(c->arena + c->used, line, p - line);
+		if (modalias_add(c, p - line) == NULL)
+			return;
+	}
+}
 
-		if (S_ISLNK(st.st_mode))
+static void modalias_walk (struct modalias_cache *c, int dfd, int known)
+{
+	struct dirent *dirent;
+	struct stat st;
+	int sub, type;
+	DIR *dir;
+
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		close(dfd);
+		return;
+	}
+
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
 			continue;
 
-		if (S_ISDIR(st.st_mode)) {
-			find_modalias(list, name);
-		} else if (strcmp(dirent->d_name, "modalias") == 0) {
-			f = fopen(name, "r");
-			if (!f)
+		type = dirent->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(dfd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
 				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+			       S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+		}
 
-			while (fgets(line, sizeof(line), f) != NULL) {
-				for (i = 0; i < sizeof(line) && (line[i] != '\n'); i++);
-				line[i] = '\0';
-				entry = (struct mod_list *) malloc(sizeof(struct mod_list));
-				if (entry == NULL) {
-					return (1);
-				}
-				entry->alias = NULL;
-				entry->alias = strdup(line);
-				entry->next = *list;
-				*list = entry;
-			}
-			fclose(f);
+		if (type == DT_DIR) {
+			/* power management attributes, never a device */
+			if (strcmp(dirent->d_name, "power") == 0)
+				continue;
+			sub = openat(dfd, dirent->d_name,
+				     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub >= 0)
+				modalias_walk(c, sub, modalias_dir_seen(c, dirent->d_ino));
+		} else if (type == DT_REG && !known &&
+			   strcmp(dirent->d_name, "modalias") == 0) {
+			modalias_read(c, dfd);
 		}
 	}
 	closedir(dir);
+}
 
-	return (0);
+/* scan SYS_PATH for modaliases of devices not seen before */
+
+static struct modalias_cache *find_modalias (void)
+{
+	struct modalias_cache *c = modalias_cache_get();
+	int dfd;
+
+	if (c == NULL)
+		return NULL;
+
+	dfd = open(SYS_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd >= 0)
+		modalias_walk(c, dfd, 0);
+
+	return c;
 }
 
-/* search module in given dir by name and ignore '_' != '-' issues */
+/* module name index
+ *
+ * The module tree is walked once and every module file is stored with its
+ * normalized name ('-' folded to '_', extension cut) as key, so a lookup by
+ * name does not need to walk /lib/modules/<release> again. */
 
-void find_kernel_module_by_name (struct kmod_struct *list, const char *path)
+#define KMOD_HASH_SIZE		4096	/* power of 2 */
+
+struct kmod_entry {
+	char			*key;		/* normalized module name */
+	char			*realname;	/* module name as spelled in the file name */
+	char			*abs_name;	/* absolute path of the module file */
+	struct kmod_entry	*next;
+};
+
+static struct kmod_entry *kmod_hash[KMOD_HASH_SIZE];
+static char *kmod_hash_root = NULL;
+
+/* copy the module name part of a file name to key, fold '-' to '_' and
+ * stop at the first '.', returns the length of the key */
+
+static size_t kmod_normalize (char *key, const char *name, size_t len_key)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len_key && name[i] != '\0' && name[i] != '.'; i++)
+		key[i] = (name[i] == '-') ? '_' : name[i];
+	key[i] = '\0';
+
+	return i;
+}
+
+/* return 1 if the file name has a kernel module extension */
+
+static int kmod_is_module_file (const char *name)
+{
+	const char *ext = strchr(name, '.');
+
+	return (ext != NULL && module_ext_len(ext, strlen(ext)) == strlen(ext));
+}
+
+static void kmod_index_add (const char *name, const char *abs_name)
+{
+	struct kmod_entry *entry;
+	char key[NAME_MAX + 1];
+	size_t len, len_abs;
+	unsigned int slot;
+
+	len = kmod_normalize(key, name, sizeof(key));
+	slot = hash_string(key, len) & (KMOD_HASH_SIZE - 1);
+
+	/* the first module found wins, like the old recursive search */
+	for (entry = kmod_hash[slot]; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0)
+			return;
+	}
+
+	/* key, realname and abs_name share one allocation */
+	len_abs = strlen(abs_name);
+	entry = arena_alloc(&alias_arena, sizeof(struct kmod_entry) + 2 * (len + 1) + len_abs + 1);
+	if (entry == NULL)
+		return;
+
+	entry->key = (char *)(entry + 1);
+	entry->realname = entry->key + len + 1;
+	entry->abs_name = entry->realname + len + 1;
+	memcpy(entry->key, key, len + 1);
+	memcpy(entry->realname, name, len);
+	entry->realname[len] = '\0';
+	memcpy(entry->abs_name, abs_name, len_abs + 1);
+
+	entry->next = kmod_hash[slot];
+	kmod_hash[slot] = entry;
+}
+
+/* the entries stay in alias_arena until alias_release() */
+
+static void kmod_index_clear (void)
+{
+	memset(kmod_hash, 0, sizeof(kmod_hash));
+}
+
+static void kmod_index_walk (const char *path)
 {
 	struct dirent *dirent;
 	DIR *dir = opendir(path);
 	char name[PATH_MAX];
 	struct stat st;
-	int i;
+	unsigned char type;
+
+	if (dir == NULL)
+		return;
 
 	while ((dirent = readdir(dir))) 
 	{
@@ -105,57 +377,549 @@ void find_kernel_module_by_name (struct kmod_struct *list, const char *path)
 			continue;
 
 		snprintf(name, sizeof (name), "%s/%s", path, dirent->d_name);
-		if (lstat(name, &st))
+
+		/* only stat if the filesystem does not fill in d_type */
+		type = dirent->d_type;
+		if (type == DT_UNKNOWN) {
+			if (lstat(name, &st))
+				continue;
+			if (S_ISLNK(st.st_mode))
+				type = DT_LNK;
+			else if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else
+				type = DT_REG;
+		}
+
+		if (type == DT_DIR)
+			kmod_index_walk(name);
+		else if (type == DT_REG && kmod_is_module_file(dirent->d_name))
+			kmod_index_add(dirent->d_name, name);
+	}
+	closedir(dir);
+}
+
+/* search module in given dir by name and ignore '_' != '-' issues,
+ * on success list->realname and list->abs_name are allocated copies */
+
+void find_kernel_module_by_name (struct kmod_struct *list, const char *path)
+{
+	struct kmod_entry *entry;
+	char key[NAME_MAX + 1];
+	size_t len;
+
+	list->realname = NULL;
+	list->abs_name = NULL;
+
+	if (kmod_hash_root == NULL || strcmp(kmod_hash_root, path) != 0) {
+		kmod_index_clear();
+		free(kmod_hash_root);
+		kmod_hash_root = strdup(path);
+		kmod_index_walk(path);
+	}
+
+	len = kmod_normalize(key, list->name, sizeof(key));
+	entry = kmod_hash[hash_string(key, len) & (KMOD_HASH_SIZE - 1)];
+	for (; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0) {
+			list->realname = strdup(entry->realname);
+			list->abs_name = strdup(entry->abs_name);
+			return;
+		}
+	}
+}
+
+/* modules.alias index
+ *
+ * modules.alias is read once per boot. The patterns are bucketed by bus
+ * (the same pci/usb/acpi split load_alias_modules() filters on) and hashed
+ * by their literal prefix (the characters before the first wildcard), so a
+ * device modalias is only fnmatch()ed against patterns which could match it. */
+
+#define ALIAS_BUS_PCI		0
+#define ALIAS_BUS_USB		1
+#define ALIAS_BUS_ACPI		2
+#define ALIAS_BUS_OTHER		3
+#define ALIAS_BUS_NUM		4
+#define ALIAS_HASH_SIZE		2048	/* hash slots per bus, power of 2 */
+#define ALIAS_MAX_PREFIX	64	/* longer literal prefixes are cut */
+
+struct alias_entry {
+	const char		*pattern;
+	const char		*module;
+	unsigned int		prefix_len;	/* literal prefix used for hashing */
+	int			hit;		/* matched a device modalias */
+	struct alias_entry	*next;		/* next entry in same hash slot */
+};
+
+struct alias_bus {
+	struct alias_entry	*hash[ALIAS_HASH_SIZE];
+	char			has_len[ALIAS_MAX_PREFIX + 1];
+};
+
+struct alias_index {
+	char			*data;		/* contents of modules.alias */
+	struct alias_entry	*entries;	/* in modules.alias order */
+	int			count;
+	struct alias_bus	bus[ALIAS_BUS_NUM];
+};
+
+static struct alias_index *alias_index = NULL;
+
+/* modules.alias.bin written by depmod, preferred over the text file */
+static struct bin_index *alias_bin = NULL;
+static int alias_bin_tried = 0;
+
+/* modules to load, collected from the matching aliases */
+struct alias_names {
+	init_t			*init;
+	char			**names;
+	int			count;
+	int			max;
+};
+
+static int alias_bus_of_pattern (const char *pattern)
+{
+	if (strncmp(pattern, "pci:", 4) == 0)
+		return ALIAS_BUS_PCI;
+	if (strncmp(pattern, "usb:", 4) == 0)
+		return ALIAS_BUS_USB;
+	if (strncmp(pattern, "acpi:", 5) == 0 || strncmp(pattern, "acpi*:", 6) == 0)
+		return ALIAS_BUS_ACPI;
+	return ALIAS_BUS_OTHER;
+}
+
+static void alias_index_add (struct alias_index *idx, struct alias_entry *entry)
+{
+	struct alias_bus *bus = &idx->bus[alias_bus_of_pattern(entry->pattern)];
+	unsigned int len, slot;
+
+	/* with FNM_NOESCAPE only '*', '?' and '[' are special */
+	len = strcspn(entry->pattern, "*?[");
+	if (len > ALIAS_MAX_PREFIX)
+		len = ALIAS_MAX_PREFIX;
+
+	entry->prefix_len = len;
+	entry->hit = 0;
+	slot = hash_string(entry->pattern, len) & (ALIAS_HASH_SIZE - 1);
+	entry->next = bus->hash[slot];
+	bus->hash[slot] = entry;
+	bus->has_len[len] = 1;
+}
+
+/* read modules.alias and build the index, returns NULL on errors */
+
+static struct alias_index *alias_index_build (init_t *init)
+{
+	struct alias_index *idx;
+	struct stat st;
+	char *p, *end, *line, *pattern, *module;
+	int fd, count = 0;
+
+	fd = open_file_read_only("%s/%s", init->moddir, ALIASFILE);
+	if (fd < 0)
+		return NULL;
+
+	idx = arena_alloc(&alias_arena, sizeof(struct alias_index));
+	if (idx == NULL || fstat(fd, &st) != 0 ||
+	    (idx->data = arena_alloc(&alias_arena, st.st_size + 1)) == NULL ||
+	    iread(fd, (unsigned char *)idx->data, st.st_size) != st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	idx->data[st.st_size] = '\0';
+	end = idx->data + st.st_size;
+
+	for (p = idx->data; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		count++;
+
+	idx->entries = arena_alloc(&alias_arena, (count + 1) * sizeof(struct alias_entry));
+	if (idx->entries == NULL)
+		return NULL;
+
+	for (line = idx->data; line < end; line = p + 1) {
+		p = memchr(line, '\n', end - line);
+		if (p == NULL)
+			p = end;
+		*p = '\0';
+
+		if (strncmp(line, "alias ", 6) != 0)
 			continue;
 
-		if (S_ISLNK(st.st_mode))
+		pattern = line + 6;
+		module = strchr(pattern, ' ');
+		if (module == NULL)
+			continue;
+		*module++ = '\0';
+		module[strcspn(module, " \t")] = '\0';
+		if (*pattern == '\0' || *module == '\0')
 			continue;
 
-		if (S_ISDIR(st.st_mode)) {
-			find_kernel_module_by_name(list, name);
-		} else {
-			if (strncmp(dirent->d_name, list->name, strlen(list->name)) == 0) {
-				list->realname = strdup(list->name);
-				list->abs_name = strdup(name);
-				closedir(dir);
-				return;
+		idx->entries[idx->count].pattern = pattern;
+		idx->entries[idx->count].module = module;
+		alias_index_add(idx, &idx->entries[idx->count]);
+		idx->count++;
+	}
+
+	return idx;
+}
+
+/* mark all patterns of the given bus which match the device modalias */
+
+static void alias_index_match (struct alias_bus *bus, const char *modalias)
+{
+	struct alias_entry *entry;
+	unsigned int len, l;
+
+	len = strlen(modalias);
+	for (l = 0; l <= ALIAS_MAX_PREFIX && l <= len; l++) {
+		if (!bus->has_len[l])
+			continue;
+
+		entry = bus->hash[hash_string(modalias, l) & (ALIAS_HASH_SIZE - 1)];
+		for (; entry != NULL; entry = entry->next) {
+			if (entry->hit || entry->prefix_len != l ||
+			    strncmp(entry->pattern, modalias, l) != 0)
+				continue;
+			if (fnmatch(entry->pattern, modalias, FNM_NOESCAPE) == 0)
+				entry->hit = 1;
+		}
+	}
+}
+
+/* call cb for the module of every alias of bus matching modalias */
+
+static void alias_index_each (struct alias_bus *bus, const char *modalias,
+			      bin_index_cb cb, void *data)
+{
+	struct alias_entry *entry;
+	unsigned int len, l;
+
+	len = strlen(modalias);
+	for (l = 0; l <= ALIAS_MAX_PREFIX && l <= len; l++) {
+		if (!bus->has_len[l])
+			continue;
+
+		entry = bus->hash[hash_string(modalias, l) & (ALIAS_HASH_SIZE - 1)];
+		for (; entry != NULL; entry = entry->next) {
+			if (entry->prefix_len != l ||
+			    strncmp(entry->pattern, modalias, l) != 0)
+				continue;
+			if (fnmatch(entry->pattern, modalias, FNM_NOESCAPE) == 0)
+				cb(entry->module, data);
+		}
+	}
+}
+
+/* mark the alias in data pending if module should be loaded but is not */
+
+static int alias_pending (const char *module, void *data)
+{
+	struct mod_list *p = data;
+
+	if (kmodule_already_loaded(NULL, module) != 1 &&
+	    !modprobe_blacklisted(module))
+		p->pending = 1;
+	return 0;
+}
+
+/* add the module of a matching alias to the set of modules to load,
+ * skip loaded and blacklisted modules, modules without file and duplicates */
+
+static int alias_collect (const char *module, void *data)
+{
+	struct alias_names *set = data;
+	struct kmod_struct kmod;
+	char **names;
+	int n;
+
+	if (kmodule_already_loaded(NULL, module) == 1 ||
+	    modprobe_blacklisted(module))
+		return 0;
+
+	kmod.name = (char *) module;
+	kmod.realname = NULL;
+	find_kernel_module_by_name(&kmod, set->init->moddir);
+	if (kmod.realname == NULL)
+		return 0;
+	free(kmod.abs_name);
+
+	for (n = 0; n < set->count; n++) {
+		if (strcmp(set->names[n], kmod.realname) == 0) {
+			free(kmod.realname);
+			return 0;
+		}
+	}
+
+	if (set->count == set->max) {
+		names = realloc(set->names, (set->max + 64) * sizeof(char *));
+		if (names == NULL) {
+			free(kmod.realname);
+			return 0;
+		}
+		set->names = names;
+		set->max += 64;
+	}
+	set->names[set->count++] = kmod.realname;
+
+	return 0;
+}
+
+/* open modules.alias.bin or build the modules.alias index, returns 0 if
+ * one of them is available */
+
+static int alias_index_open (init_t *init)
+{
+	char path[PATH_MAX];
+
+	if (!alias_bin_tried) {
+		alias_bin_tried = 1;
+		snprintf(path, sizeof(path), "%s/%s.bin", init->moddir, ALIASFILE);
+		alias_bin = bin_index_open(path);
+	}
+
+	if (alias_bin == NULL && alias_index == NULL)
+		alias_index = alias_index_build(init);
+
+	if (alias_bin == NULL && alias_index == NULL) {
+		msg(init,LOG_ERR,"load_alias_modules: can not open %s/%s\n",init->moddir,ALIASFILE);
+		return(1);
+	}
+
+	return (0);
+}
+
+/* storage-first coldplug
+ *
+ * With igel_coldplug=storage on the kernel command line only the drivers
+ * needed to reach the boot device (and a keyboard for the rescue shell)
+ * are loaded from the initramfs, udev of the real root loads the others.
+ * PCI and USB devices are selected by the class codes in their modalias,
+ * all others by the patterns below and the ones in COLDPLUG_ALLOW_FILE. */
+
+#define COLDPLUG_ALLOW_FILE	"/etc/igel/coldplug.allow"
+
+static const char *coldplug_allow_default[] = {
+	"scsi:t-0x00*",		/* disks */
+	"scsi:t-0x05*",		/* cd/dvd drives */
+	"scsi:t-0x0e*",		/* reduced block command disks */
+	"mmc:block",
+	"hid:*",
+	"virtio:d00000002v*",	/* virtio block */
+	"virtio:d00000008v*",	/* virtio scsi */
+	"xen:vbd",
+	"acpi:PNP0D40:*",	/* SD host controllers */
+	"acpi:80860F14:*",
+	"acpi:80860F16:*",
+	"acpi:INT33BB:*",
+	"acpi:80865ACA:*",
+	"acpi:80865AD0:*",
+	"acpi:AMDI0040:*",
+	"pci:v000010ECd*sv*sd*bcFFsc00i*",	/* Realtek card readers */
+	NULL
+};
+
+static char **coldplug_allow = NULL;
+static int coldplug_allow_count = 0;
+static int coldplug_allow_read = 0;
+
+/* read the patterns of COLDPLUG_ALLOW_FILE, one per line */
+
+static void coldplug_read_allow (init_t *init)
+{
+	char line[256], **n;
+	size_t len;
+	FILE *f;
+
+	coldplug_allow_read = 1;
+
+	f = fopen(COLDPLUG_ALLOW_FILE, "re");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		len = strcspn(line, "# \t\r\n");
+		if (len == 0)
+			continue;
+		line[len] = '\0';
+
+		n = realloc(coldplug_allow, (coldplug_allow_count + 1) * sizeof(char *));
+		if (n == NULL)
+			break;
+		coldplug_allow = n;
+		coldplug_allow[coldplug_allow_count] = strdup(line);
+		if (coldplug_allow[coldplug_allow_count] != NULL)
+			coldplug_allow_count++;
+	}
+	fclose(f);
+
+	msg(init,LOG_INFO,"coldplug: %d patterns from %s\n",
+	    coldplug_allow_count, COLDPLUG_ALLOW_FILE);
+}
+
+/* returns 1 if the driver of the device with this modalias is needed
+ * before the switch to the real root */
+
+static int coldplug_needed (init_t *init, const char *modalias)
+{
+	unsigned int base, sub, prog;
+	const char *p;
+	int i;
+
+	if (strncmp(modalias, "pci:", 4) == 0 &&
+	    (p = strstr(modalias, "bc")) != NULL &&
+	    sscanf(p, "bc%2xsc%2xi%2x", &base, &sub, &prog) == 3) {
+		if (base == 0x01 ||				/* mass storage */
+		    (base == 0x0c && sub == 0x03) ||		/* USB host */
+		    (base == 0x08 && sub == 0x05))		/* SD host */
+			return 1;
+	}
+
+	if (strncmp(modalias, "usb:", 4) == 0) {
+		if ((p = strstr(modalias, "dc")) != NULL &&
+		    sscanf(p, "dc%2x", &base) == 1 && base == 0x09)
+			return 1;				/* hub */
+		if ((p = strstr(modalias, "ic")) != NULL &&
+		    sscanf(p, "ic%2x", &base) == 1 &&
+		    (base == 0x08 || base == 0x03 || base == 0x09))
+			return 1;				/* storage, HID, hub */
+	}
+
+	for (i = 0; coldplug_allow_default[i] != NULL; i++) {
+		if (fnmatch(coldplug_allow_default[i], modalias, 0) == 0)
+			return 1;
+	}
+
+	if (!coldplug_allow_read)
+		coldplug_read_allow(init);
+
+	for (i = 0; i < coldplug_allow_count; i++) {
+		if (fnmatch(coldplug_allow[i], modalias, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* load the modules of all aliases of the given buses matching one of the
+ * modaliases in list, afterwards the pending flag of the entries tells
+ * which of them still have a module which is not loaded */
+
+static void load_mod_list (init_t *init, struct mod_list *list, int first, int last)
+{
+	struct mod_list *p = NULL, **pp;
+	struct alias_names set;
+	const char *origin;
+	int bus, i, n, deferred = 0;
+
+	memset(&set, 0, sizeof(set));
+	set.init = init;
+
+	/* leave the devices not needed for booting to the real root */
+	if (init->coldplug_storage) {
+		for (pp = &list; *pp != NULL; ) {
+			if (coldplug_needed(init, (*pp)->alias)) {
+				pp = &(*pp)->next;
 			} else {
-				for (i=0; list->name[i] != '\0' && dirent->d_name[i] != '\0'; i++) {
-					if (list->name[i] == '_' || list->name[i] == '-') {
-						if (dirent->d_name[i] != '_' && dirent->d_name[i] != '-')
-							break;
-					} else {
-						if (dirent->d_name[i] != list->name[i])
-							break;
-					}
-				}
-				if (list->name[i] == '\0') {
-					list->realname = strndup(dirent->d_name, i);
-					list->abs_name = strdup(name);
-					closedir(dir);
-					return;
-				}
+				*pp = (*pp)->next;
+				deferred++;
 			}
 		}
+		if (deferred > 0)
+			msg(init,LOG_INFO,"coldplug: %d devices left to the real root\n", deferred);
+	}
+
+	if (alias_bin != NULL) {
+		/* the trie only visits the patterns which can match */
+		for (p = list; p != NULL; p = p->next) {
+			bus = alias_bus_of_pattern(p->alias);
+			if (bus >= first && bus <= last)
+				bin_index_search_wild(alias_bin, p->alias, alias_collect, &set);
+		}
+	} else {
+		for (p = list; p != NULL; p = p->next) {
+			for (bus = first; bus <= last; bus++)
+				alias_index_match(&alias_index->bus[bus], p->alias);
+		}
+
+		/* collect in modules.alias order, like a linear scan would do */
+		for (i = 0; i < alias_index->count; i++) {
+			if (!alias_index->entries[i].hit)
+				continue;
+			alias_index->entries[i].hit = 0;
+			alias_collect(alias_index->entries[i].module, &set);
+		}
+	}
+
+	/* insert the whole set in parallel */
+	if (set.count > 0) {
+		origin = modtrace_push("alias");
+		modprobe_batch(init, (const char **) set.names, set.count);
+		modtrace_pop(origin);
+	}
+
+	for (n = 0; n < set.count; n++)
+		free(set.names[n]);
+	free(set.names);
+
+	/* a module which failed or has no file yet is tried again by the
+	   next scan */
+	for (p = list; p != NULL; p = p->next) {
+		p->pending = 0;
+		if (alias_bin != NULL) {
+			bus = alias_bus_of_pattern(p->alias);
+			if (bus >= first && bus <= last)
+				bin_index_search_wild(alias_bin, p->alias, alias_pending, p);
+		} else {
+			for (bus = first; bus <= last; bus++)
+				alias_index_each(&alias_index->bus[bus], p->alias,
+						 alias_pending, p);
+		}
 	}
-	closedir(dir);
 }
 
-/* function to free linked list mod_list */
+/* load the modules of all cached modaliases not yet matched against the
+ * buses first..last */
 
-static void free_mod_list (struct mod_list **list)
+static void load_cached_modaliases (init_t *init, struct modalias_cache *c, int first, int last)
 {
-	struct mod_list *p = NULL, *d = NULL;
+	struct mod_list *list;
+	unsigned int mask = 0;
+	int bus, i, n = 0, *ids;
 
-	p = *list;
+	for (bus = first; bus <= last; bus++)
+		mask |= 1 << bus;
 
-	while (p != NULL) {
-		if (p->alias != NULL)
-			free(p->alias);
-		d = p;
-		p = p->next;
-		free(d);
+	list = calloc(c->count + 1, sizeof(struct mod_list));
+	ids = malloc((c->count + 1) * sizeof(int));
+	if (list == NULL || ids == NULL) {
+		free(list);
+		free(ids);
+		return;
 	}
+
+	for (i = 0; i < c->count; i++) {
+		if ((c->entries[i].done & mask) == mask)
+			continue;
+		ids[n] = i;
+		list[n].alias = c->arena + c->entries[i].offset;
+		if (n > 0)
+			list[n - 1].next = &list[n];
+		n++;
+	}
+
+	if (n > 0)
+		load_mod_list(init, list, first, last);
+
+	/* only done once all of its modules are loaded */
+	for (i = 0; i < n; i++) {
+		if (!list[i].pending)
+			c->entries[ids[i]].done |= mask;
+	}
+
+	free(ids);
+	free(list);
 }
 
 /* load all modules which modalias is present in the /sys/device path
@@ -164,75 +928,124 @@ static void free_mod_list (struct mod_list **list)
 int
 load_alias_modules(init_t *init, const char* device)
 {
-	char filename[MAXPATHLEN], *module, line[LINELENGTH];
-	struct mod_list *list = NULL, *p = NULL;
-	struct kmod_struct kmod;
-	FILE *alias_file;
-	int i;
+	struct modalias_cache *c;
+	int first = 0, last = ALIAS_BUS_NUM - 1;
 
-	sprintf(filename, "%s/%s", init->moddir, ALIASFILE);
-	if ((alias_file = fopen(filename, "r")) == NULL) {
-		msg(init,LOG_ERR,"load_alias_modules: can not open %s\n",filename);
+	if (alias_index_open(init) != 0)
 		return(1);
-	}
 
-	if (find_modalias (&list, SYS_PATH) != 0) {
+	c = find_modalias();
+	if (c == NULL) {
 		msg(init,LOG_ERR,"failed to allocate memory\n");
-		free_mod_list(&list);
 		return(1);
 	}
 
-	while(fgets(line, LINELENGTH, alias_file) != NULL) {
-		
-		if (strncmp(line, "alias ", 6) != 0)
-			continue;
+	/* if device is pci only load pci modules,
+	 * if device is usb only load usb modules,
+	 * if device is acpi only load acpi modules */
 
-		/* if device is pci only load pci modules,
-		 * if device is usb only load usb modules,
-		 * if device is acpi only load acpi modules */
+	if (strcmp(device, "usb") == 0) {
+		first = last = ALIAS_BUS_USB;
+	} else if (strcmp(device, "pci") == 0) {
+		first = last = ALIAS_BUS_PCI;
+	} else if (strcmp(device, "acpi") == 0) {
+		first = last = ALIAS_BUS_ACPI;
+	}
 
-		if (strcmp(device, "usb") == 0) {
-			if (strncmp(&(line[6]), "usb:", 4) != 0)
-				continue;
-		} else if (strcmp(device, "pci") == 0) {
-			if (strncmp(&(line[6]), "pci:", 4) != 0)
-				continue;
-		} else if (strcmp(device, "acpi") == 0) {
-			if (strncmp(&(line[6]), "acpi:", 5) != 0 && strncmp(&(line[6]), "acpi*:", 6) != 0)
-				continue;
-		}
+	load_cached_modaliases(init, c, first, last);
+
+	return (0);
+}
+
+/* load the modules for the given modaliases, e.g. taken from uevents */
+
+int
+load_modalias_modules(init_t *init, char **modaliases, int count)
+{
+	struct modalias_cache *c;
+	struct modalias_entry *entry;
+	struct mod_list *list;
+	size_t len;
+	int i, n = 0, *ids;
+
+	if (count <= 0)
+		return (0);
 
-		p = list;
-
-		for (i=6; line[i] != '\0' && line[i] != ' ' && line[i] != '\n'; i++);
-		line[i] = '\0';
-
-		module = &(line[i+1]);
-		for (i=0; module[i] != '\0' && (module[i] != '\n'); i++);
-		module[i] = '\0';
-
-		while (p != NULL) {
-			if (fnmatch(&(line[6]), p->alias, FNM_NOESCAPE) == 0) {
-				if (kmodule_already_loaded(NULL, module) != 1 ) {
-					kmod.name = module;
-					kmod.realname = NULL;
-					find_kernel_module_by_name(&kmod, init->moddir);
-					if (kmod.realname != NULL) {
-						load_kernel_module(init, kmod.realname);
-						free(kmod.abs_name);
-						free(kmod.realname);
-					}
-				}
-				break;
+	if (alias_index_open(init) != 0)
+		return(1);
+
+	list = calloc(count, sizeof(struct mod_list));
+	ids = malloc(count * sizeof(int));
+	if (list == NULL || ids == NULL) {
+		free(list);
+		free(ids);
+		return(1);
+	}
+
+	/* remember them, so a later scan does not match them again */
+	c = modalias_cache_get();
+
+	for (i = 0; i < count; i++) {
+		len = strlen(modaliases[i]);
+		ids[n] = -1;
+		if (c != NULL && modalias_reserve(c, len + 1) == 0) {
+			memcpy(c->arena + c->used, modaliases[i], len);
+			entry = modalias_add(c, len);
+			if (entry != NULL) {
+				if (entry->done == (1 << ALIAS_BUS_NUM) - 1)
+					continue;
+				/* the entries move when the cache grows */
+				ids[n] = entry - c->entries;
 			}
-			p = p->next;
 		}
+		list[n].alias = modaliases[i];
+		if (n > 0)
+			list[n - 1].next = &list[n];
+		n++;
+	}
+
+	if (n > 0)
+		load_mod_list(init, list, 0, ALIAS_BUS_NUM - 1);
+
+	/* only done once all of its modules are loaded */
+	for (i = 0; i < n; i++) {
+		if (ids[i] >= 0 && !list[i].pending)
+			c->entries[ids[i]].done = (1 << ALIAS_BUS_NUM) - 1;
 	}
 
-	free_mod_list(&list);
-	fclose(alias_file);
+	free(ids);
+	free(list);
 
 	return (0);
 }
 
+/* free the modalias cache and the module and alias indexes once the
+ * modules are loaded, they are built again when needed */
 
+void
+alias_release (init_t *init)
+{
+	size_t total;
+
+	if (modalias_cache != NULL) {
+		free(modalias_cache->arena);
+		free(modalias_cache->entries);
+		free(modalias_cache->dirs);
+		free(modalias_cache);
+		modalias_cache = NULL;
+	}
+
+	kmod_index_clear();
+	free(kmod_hash_root);
+	kmod_hash_root = NULL;
+	alias_index = NULL;
+
+	bin_index_close(alias_bin);
+	alias_bin = NULL;
+	alias_bin_tried = 0;
+
+	total = arena_release(&alias_arena);
+	if (total > 0)
+		msg(init,LOG_INFO,"load_alias_modules: released %zu kB of alias data\n",
+		    total / 1024);
+}
@@ -0,0 +1,164 @@
+/*
+ * initramfs init program.
+ * bump allocator for data which is released all at once.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/types.h>
+#include "init.h"
+
+/* Allocations are carved from chunks of ARENA_CHUNK bytes and are never
+ * freed on their own, arena_release() frees all chunks. Larger requests
+ * get a chunk of their own. An arena is not thread safe. */
+
+#define ARENA_CHUNK	(64 * 1024)
+#define ARENA_ALIGN	16
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	/* data follows, aligned to ARENA_ALIGN */
+};
+
+#define ARENA_HDR	((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+static struct arena_chunk *arena_chunk_new (struct arena *a, size_t size)
+{
+	struct arena_chunk *c;
+
+	c = malloc(ARENA_HDR + size);
+	if (c == NULL)
+		return NULL;
+	c->size = size;
+	c->used = 0;
+	a->total += ARENA_HDR + size;
+
+	return c;
+}
+
+/* returns size bytes of zeroed memory, NULL if out of memory */
+
+void *
+arena_alloc (struct arena *a, size_t size)
+{
+	struct arena_chunk *c;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (size == 0)
+		size = ARENA_ALIGN;
+
+	if (size > ARENA_CHUNK / 4) {
+		/* a chunk of its own, behind the current one so the space
+		   left there is still used */
+		c = arena_chunk_new(a, size);
+		if (c == NULL)
+			return NULL;
+		c->used = size;
+		if (a->chunks) {
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		} else {
+			c->next = NULL;
+			a->chunks = c;
+		}
+		p = (char *) c + ARENA_HDR;
+		memset(p, 0, size);
+		return p;
+	}
+
+	c = a->chunks;
+	if (c == NULL || c->size - c->used < size) {
+		c = arena_chunk_new(a, ARENA_CHUNK);
+		if (c == NULL)
+			return NULL;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+
+	p = (char *) c + ARENA_HDR + c->used;
+	c->used += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+char *
+arena_strndup (struct arena *a, const char *s, size_t len)
+{
+	char *p;
+
+	len = strnlen(s, len);
+	p = arena_alloc(a, len + 1);
+	if (p != NULL)
+		memcpy(p, s, len);
+
+	return p;
+}
+
+char *
+arena_strdup (struct arena *a, const char *s)
+{
+	return arena_strndup(a, s, strlen(s));
+}
+
+char *
+arena_printf (struct arena *a, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return NULL;
+
+	p = arena_alloc(a, len + 1);
+	if (p == NULL)
+		return NULL;
+
+	va_start(ap, fmt);
+	vsnprintf(p, len + 1, fmt, ap);
+	va_end(ap);
+
+	return p;
+}
+
+/* free everything allocated from the arena, returns the number of bytes
+ * released */
+
+size_t
+arena_release (struct arena *a)
+{
+	struct arena_chunk *c, *next;
+	size_t total = a->total;
+
+	for (c = a->chunks; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->chunks = NULL;
+	a->total = 0;
+
+	return total;
+}
@@ -0,0 +1,377 @@
+/*
+ * initramfs init program.
+ * read the binary module indexes (modules.*.bin) generated by depmod.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "init.h"
+
+/* The index is a trie written by depmod (kmod index format version 2).
+ * All numbers are big endian. The file starts with magic, version and the
+ * offset of the root node. A node offset carries flags telling what the
+ * node contains:
+ *
+ *   prefix    NUL terminated string of characters shared by all children
+ *   children  first and last child character, followed by one offset per
+ *             character in that range (0 = no child)
+ *   values    number of values, each a priority and a NUL terminated string
+ */
+
+#define BIN_INDEX_MAGIC		0xB007F457
+#define BIN_INDEX_VERSION_MAJOR	0x0002
+#define BIN_NODE_PREFIX		0x80000000
+#define BIN_NODE_VALUES		0x40000000
+#define BIN_NODE_CHILDS		0x20000000
+#define BIN_NODE_MASK		0x0FFFFFFF
+
+#define BIN_KEY_MAX		1024
+
+struct bin_index {
+	const unsigned char	*data;
+	size_t			size;
+	uint32_t		root;
+};
+
+struct bin_node {
+	const char		*prefix;
+	int			first;		/* first child character */
+	int			last;		/* last child character */
+	const unsigned char	*children;
+	uint32_t		value_count;
+	const unsigned char	*values;
+};
+
+/* the pattern collected below a wildcard during a wildcard search */
+struct bin_wild {
+	char			buf[BIN_KEY_MAX];
+	size_t			len;
+	const char		*subkey;	/* part of the key the pattern has to match */
+	bin_index_cb		cb;
+	void			*data;
+	int			count;
+};
+
+static uint32_t bin_u32 (const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	       ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* decode the node at offset, returns 0 if the node is out of bounds */
+
+static int bin_read_node (const struct bin_index *idx, uint32_t offset, struct bin_node *node)
+{
+	const unsigned char *p, *end = idx->data + idx->size;
+	size_t len;
+
+	if ((offset & BIN_NODE_MASK) >= idx->size)
+		return 0;
+	p = idx->data + (offset & BIN_NODE_MASK);
+
+	node->prefix = "";
+	if (offset & BIN_NODE_PREFIX) {
+		len = strnlen((const char *) p, end - p);
+		if (p + len >= end)
+			return 0;
+		node->prefix = (const char *) p;
+		p += len + 1;
+	}
+
+	node->first = 128;
+	node->last = 0;
+	node->children = NULL;
+	if (offset & BIN_NODE_CHILDS) {
+		if (p + 2 > end)
+			return 0;
+		node->first = p[0];
+		node->last = p[1];
+		node->children = p + 2;
+		p += 2 + 4 * (node->last - node->first + 1);
+		if (node->last < node->first || p > end)
+			return 0;
+	}
+
+	node->value_count = 0;
+	node->values = NULL;
+	if (offset & BIN_NODE_VALUES) {
+		if (p + 4 > end)
+			return 0;
+		node->value_count = bin_u32(p);
+		node->values = p + 4;
+	}
+
+	return 1;
+}
+
+static int bin_read_child (const struct bin_index *idx, const struct bin_node *parent,
+			   int ch, struct bin_node *child)
+{
+	uint32_t offset;
+
+	if (ch < parent->first || ch > parent->last)
+		return 0;
+
+	offset = bin_u32(parent->children + 4 * (ch - parent->first));
+	if (offset == 0)
+		return 0;
+
+	return bin_read_node(idx, offset, child);
+}
+
+/* call cb for every value of the node, values are sorted by priority */
+
+static int bin_node_values (const struct bin_index *idx, const struct bin_node *node,
+			    bin_index_cb cb, void *data)
+{
+	const unsigned char *p = node->values, *end = idx->data + idx->size;
+	uint32_t i;
+	size_t len;
+
+	for (i = 0; i < node->value_count; i++) {
+		if (p + 4 >= end)
+			break;
+		p += 4;		/* priority */
+		len = strnlen((const char *) p, end - p);
+		if (p + len >= end)
+			break;
+		if (cb((const char *) p, data) != 0)
+			return (int) i + 1;
+		p += len + 1;
+	}
+
+	return (int) i;
+}
+
+/* module names and aliases are stored with '-' folded to '_', except
+ * inside of [] character classes */
+
+static int bin_normalize (char *key, const char *s, size_t len_key)
+{
+	size_t i;
+	int bracket = 0;
+
+	for (i = 0; s[i] != '\0'; i++) {
+		if (i + 1 >= len_key)
+			return -1;
+		if (s[i] == '[')
+			bracket = 1;
+		else if (s[i] == ']')
+			bracket = 0;
+		key[i] = (s[i] == '-' && !bracket) ? '_' : s[i];
+	}
+	key[i] = '\0';
+
+	return 0;
+}
+
+/* open and map a binary index, returns NULL if the file does not exist
+ * or is not a supported index */
+
+struct bin_index *
+bin_index_open (const char *filename)
+{
+	struct bin_index *idx;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < 12) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (bin_u32(data) != BIN_INDEX_MAGIC ||
+	    (bin_u32((unsigned char *) data + 4) >> 16) != BIN_INDEX_VERSION_MAJOR ||
+	    (idx = malloc(sizeof(struct bin_index))) == NULL) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	idx->data = data;
+	idx->size = st.st_size;
+	idx->root = bin_u32((unsigned char *) data + 8);
+
+	return idx;
+}
+
+void
+bin_index_close (struct bin_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	munmap((void *) idx->data, idx->size);
+	free(idx);
+}
+
+static int bin_first_value (const char *value, void *data)
+{
+	*(const char **) data = value;
+	return 1;
+}
+
+/* exact lookup, returns the value with the highest priority (pointing
+ * into the mapping) or NULL if key is not in the index */
+
+const char *
+bin_index_search (struct bin_index *idx, const char *s)
+{
+	struct bin_node node;
+	const char *value = NULL;
+	char key[BIN_KEY_MAX];
+	int i = 0, j;
+
+	if (bin_normalize(key, s, sizeof(key)) != 0 ||
+	    !bin_read_node(idx, idx->root, &node))
+		return NULL;
+
+	for (;;) {
+		for (j = 0; node.prefix[j]; j++) {
+			if (node.prefix[j] != key[i + j])
+				return NULL;
+		}
+		i += j;
+
+		if (key[i] == '\0') {
+			if (node.value_count == 0)
+				return NULL;
+			bin_node_values(idx, &node, bin_first_value, &value);
+			return value;
+		}
+
+		if (!bin_read_child(idx, &node, (unsigned char) key[i], &node))
+			return NULL;
+		i++;
+	}
+}
+
+/* collect every pattern below node (starting at prefix position j) and
+ * report the values of all patterns matching the rest of the key */
+
+static void bin_search_all (const struct bin_index *idx, const struct bin_node *node,
+			    int j, struct bin_wild *wild)
+{
+	struct bin_node child;
+	size_t pushed = strlen(node->prefix + j);
+	int ch;
+
+	if (wild->len + pushed + 2 > sizeof(wild->buf))
+		return;
+	memcpy(wild->buf + wild->len, node->prefix + j, pushed);
+	wild->len += pushed;
+
+	for (ch = node->first; ch <= node->last; ch++) {
+		if (!bin_read_child(idx, node, ch, &child))
+			continue;
+		wild->buf[wild->len++] = ch;
+		bin_search_all(idx, &child, 0, wild);
+		wild->len--;
+	}
+
+	if (node->value_count > 0) {
+		wild->buf[wild->len] = '\0';
+		if (fnmatch(wild->buf, wild->subkey, 0) == 0)
+			wild->count += bin_node_values(idx, node, wild->cb, wild->data);
+	}
+
+	wild->len -= pushed;
+}
+
+/* follow the wildcard child ch of node, if there is one */
+
+static void bin_search_wildchild (const struct bin_index *idx, const struct bin_node *node,
+				  int ch, const char *subkey, struct bin_wild *wild)
+{
+	struct bin_node child;
+
+	if (!bin_read_child(idx, node, ch, &child))
+		return;
+
+	wild->buf[wild->len++] = ch;
+	wild->subkey = subkey;
+	bin_search_all(idx, &child, 0, wild);
+	wild->len--;
+}
+
+/* wildcard lookup, as used for modules.alias.bin where the keys are
+ * patterns: cb is called for the values of every pattern matching the
+ * given string, returns the number of values reported */
+
+int
+bin_index_search_wild (struct bin_index *idx, const char *s, bin_index_cb cb, void *data)
+{
+	struct bin_wild wild;
+	struct bin_node node;
+	char key[BIN_KEY_MAX];
+	int i = 0, j, ch;
+
+	if (bin_normalize(key, s, sizeof(key)) != 0 ||
+	    !bin_read_node(idx, idx->root, &node))
+		return 0;
+
+	wild.len = 0;
+	wild.cb = cb;
+	wild.data = data;
+	wild.count = 0;
+
+	for (;;) {
+		for (j = 0; node.prefix[j]; j++) {
+			ch = node.prefix[j];
+
+			if (ch == '*' || ch == '?' || ch == '[') {
+				wild.subkey = &key[i + j];
+				bin_search_all(idx, &node, j, &wild);
+				return wild.count;
+			}
+
+			if (ch != key[i + j])
+				return wild.count;
+		}
+		i += j;
+
+		bin_search_wildchild(idx, &node, '*', &key[i], &wild);
+		bin_search_wildchild(idx, &node, '?', &key[i], &wild);
+		bin_search_wildchild(idx, &node, '[', &key[i], &wild);
+
+		if (key[i] == '\0') {
+			wild.count += bin_node_values(idx, &node, cb, data);
+			return wild.count;
+		}
+
+		if (!bin_read_child(idx, &node, (unsigned char) key[i], &node))
+			return wild.count;
+		i++;
+	}
+}
@@ -0,0 +1,265 @@
+/*
+ * initramfs init program.
+ * remember the boot device and check it first at the next boot.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "init.h"
+
+/* The boot registry of the boot device keeps
+ *
+ *   boot_hint      <partition>|<boot_id>|<disk id>
+ *
+ * where the disk id is the WWID or serial number the kernel shows in
+ * sysfs. The hint is read together with the module plan from the first
+ * partition of the disks which are readable before the storage drivers
+ * are loaded, and by boothint_load() from the internal disks which show
+ * up later. The disk the hint points to is checked first, starting with
+ * its partition. */
+
+#define BOOTHINT_NODE	"/dev/.boothint"
+#define BOOTHINT_DISKS	32
+
+/* the WWID or serial number of a disk, NULL if it has none */
+
+static char *boothint_disk_id (const char *disk, char *buf, size_t len)
+{
+	static const char *ids[] = {
+		"wwid", "device/wwid", "serial", "device/serial", "device/cid", NULL
+	};
+	char *p;
+	int i;
+
+	for (i = 0; ids[i] != NULL; i++) {
+		p = read_file(len - 1, buf, len, "/sys/block/%s/%s", disk, ids[i]);
+		if (p == NULL)
+			continue;
+		p[strcspn(p, "\n")] = '\0';
+		while (p[0] != '\0' && p[strlen(p) - 1] == ' ')
+			p[strlen(p) - 1] = '\0';
+		/* '|' separates the fields of the hint */
+		if (p[0] != '\0' && strchr(p, '|') == NULL)
+			return p;
+	}
+
+	return NULL;
+}
+
+/* take over the value of BOOTHINT_KEY read from a boot registry, unless
+ * a hint is known already */
+
+void
+boothint_set (init_t *init, char *hint)
+{
+	if (init->boot_hint == NULL && hint != NULL && strchr(hint, '|') != NULL)
+		init->boot_hint = hint;
+	else
+		free(hint);
+}
+
+/* look for a hint in the boot registry on the first partition of the
+ * internal disks, each disk is read once */
+
+void
+boothint_load (init_t *init)
+{
+	static char seen[BOOTHINT_DISKS][32];
+	static int n_seen = 0;
+	struct bootsnap *s;
+	struct dirent *dent;
+	char name[PATH_MAX], *buf;
+	const char *prefix, *p;
+	unsigned int major, minor;
+	DIR *dir;
+	int i;
+
+	if (init->boot_hint != NULL)
+		return;
+
+	dir = opendir("/sys/block");
+	if (dir == NULL)
+		return;
+
+	while (init->boot_hint == NULL && (dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.' ||
+		    strstr(dent->d_name, "ram") != NULL ||
+		    strstr(dent->d_name, "loop") != NULL ||
+		    strlen(dent->d_name) >= sizeof(seen[0]))
+			continue;
+		/* USB disks are slow to read and checked last anyway */
+		if (boothint_rank(dent->d_name) >= 3)
+			continue;
+		for (i = 0; i < n_seen; i++) {
+			if (strcmp(seen[i], dent->d_name) == 0)
+				break;
+		}
+		if (i < n_seen)
+			continue;
+
+		if (strncmp(dent->d_name, "mmcblk", 6) == 0 ||
+		    strncmp(dent->d_name, "nvme", 4) == 0)
+			prefix = "p";
+		else
+			prefix = "";
+
+		/* without the partition yet the disk is read next time */
+		buf = read_file(16, name, sizeof(name), "/sys/block/%s/%s%s1/dev",
+				dent->d_name, dent->d_name, prefix);
+		if (buf == NULL || sscanf(buf, "%u:%u", &major, &minor) != 2)
+			continue;
+		if (n_seen < BOOTHINT_DISKS)
+			strcpy(seen[n_seen++], dent->d_name);
+
+		unlink(BOOTHINT_NODE);
+		if (mknod(BOOTHINT_NODE, S_IFBLK | S_IRUSR | S_IWUSR,
+			  makedev(major, minor)) != 0)
+			continue;
+
+		s = bootsnap_load(BOOTHINT_NODE);
+		if (s != NULL) {
+			p = bootsnap_get(s, BOOTHINT_KEY);
+			boothint_set(init, p ? strdup(p) : NULL);
+			bootsnap_free(s);
+		}
+		unlink(BOOTHINT_NODE);
+	}
+	closedir(dir);
+}
+
+/* the disk the hint points to, NULL if there is no hint, it was made
+ * for another boot_id or the disk is not there. *part is the partition
+ * of the hint. */
+
+const char *
+boothint_disk (init_t *init, char *disk, size_t len_disk, int *part)
+{
+	char buf[256], *part_str, *boot_id, *id, *p;
+	struct dirent *dent;
+	DIR *dir;
+	int found = 0;
+
+	if (init->boot_hint == NULL)
+		return NULL;
+
+	part_str = strdup(init->boot_hint);
+	if (part_str == NULL)
+		return NULL;
+	boot_id = strchr(part_str, '|');
+	*boot_id++ = '\0';
+	id = strchr(boot_id, '|');
+	if (id == NULL || id[1] == '\0')
+		goto out;
+	*id++ = '\0';
+
+	if (strcmp(boot_id, init->boot_id ? init->boot_id : "") != 0) {
+		msg(init,LOG_INFO,"boothint: made for another boot id\n");
+		goto out;
+	}
+
+	dir = opendir("/sys/block");
+	if (dir == NULL)
+		goto out;
+	while (!found && (dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+		p = boothint_disk_id(dent->d_name, buf, sizeof(buf));
+		if (p != NULL && strcmp(p, id) == 0 && strlen(dent->d_name) < len_disk) {
+			strcpy(disk, dent->d_name);
+			found = 1;
+		}
+	}
+	closedir(dir);
+
+	if (found) {
+		msg(init,LOG_INFO,"boothint: last boot device %s, partition %s\n", disk, part_str);
+		*part = atoi(part_str);
+		if (*part < 1 || *part > MAX_PART_NUM)
+			*part = 0;
+	}
+out:
+	free(part_str);
+	return found ? disk : NULL;
+}
+
+/* forget the hint, it did not lead to the boot device */
+
+void
+boothint_drop (init_t *init)
+{
+	free(init->boot_hint);
+	init->boot_hint = NULL;
+}
+
+/* store the device found in the boot registry snapshot of the boot
+ * partition, only changed if the hint changed */
+
+void
+boothint_save (init_t *init)
+{
+	char buf[256], hint[512], *id;
+	const char *old;
+
+	if (init->devname == NULL || init->bootsnap == NULL)
+		return;
+	id = boothint_disk_id(init->devname, buf, sizeof(buf));
+	if (id == NULL)
+		return;
+
+	snprintf(hint, sizeof(hint), "%d|%s|%s", init->part,
+		 init->boot_id ? init->boot_id : "", id);
+	hint[sizeof(hint)-1] = '\0';
+	if (init->boot_hint != NULL && strcmp(init->boot_hint, hint) == 0)
+		return;
+
+	old = bootsnap_get(init->bootsnap, BOOTHINT_KEY);
+	if (old == NULL || strcmp(old, hint) != 0)
+		bootsnap_set(init->bootsnap, BOOTHINT_KEY, hint);
+}
+
+/* order in which disks are checked: internal storage before removable
+ * USB devices */
+
+int
+boothint_rank (const char *disk)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t len;
+
+	if (strncmp(disk, "nvme", 4) == 0)
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/block/%s", disk);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = '\0';
+		if (strstr(link, "/usb") != NULL)
+			return 3;
+	}
+
+	if (strncmp(disk, "mmcblk", 6) == 0)
+		return 1;
+	return 2;
+}
@@ -0,0 +1,236 @@
+/*
+ * initramfs init program.
+ * snapshot of a boot registry, read once and written once.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <igel64/os11/bootregfs.h>
+#include "init.h"
+
+/* bootsnap_load() opens the boot registry of a partition once and copies
+ * the keys init uses, bootsnap_get() answers from the copy. bootsnap_set()
+ * only changes the copy, bootsnap_commit() writes the changed keys with
+ * one read-write open of the registry.
+ * The registry can not list its keys, a key missing in snap_keys[] is
+ * never in the snapshot. */
+
+static const char *snap_keys[] = {
+	"boot_id", "use_backports", "igel_poffset",
+	"major_update", "major_update_keep_jre", "major_update_keep_nvidia",
+	BOOTHINT_KEY, "modplan_fp", "modplan_cnt", NULL
+};
+
+/* numbered keys, read from <prefix>0 up to the first missing one */
+static const char *snap_numbered[] = { "modplan_", NULL };
+#define SNAP_MAX_NUMBERED	32
+
+struct bootsnap_entry {
+	char	*key;
+	char	*value;		/* NULL if the key is not set */
+	int	dirty;
+};
+
+struct bootsnap {
+	char			*device;
+	int			count;
+	int			max;
+	struct bootsnap_entry	*ent;
+};
+
+static struct bootsnap_entry *snap_find (struct bootsnap *s, const char *key)
+{
+	int i;
+
+	for (i = 0; i < s->count; i++) {
+		if (strcmp(s->ent[i].key, key) == 0)
+			return &s->ent[i];
+	}
+	return NULL;
+}
+
+/* new entry for key, takes over value */
+
+static struct bootsnap_entry *snap_add (struct bootsnap *s, const char *key, char *value)
+{
+	struct bootsnap_entry *n;
+
+	if (s->count == s->max) {
+		n = realloc(s->ent, (s->max + 16) * sizeof(struct bootsnap_entry));
+		if (n == NULL)
+			return NULL;
+		s->ent = n;
+		s->max += 16;
+	}
+	n = &s->ent[s->count];
+	n->key = strdup(key);
+	if (n->key == NULL)
+		return NULL;
+	n->value = value;
+	n->dirty = 0;
+	s->count++;
+
+	return n;
+}
+
+static int snap_read (struct bootsnap *s, bootreg_data *hndl, const char *key)
+{
+	char *p = NULL;
+
+	bootreg_get(hndl, key, &p);
+	if (p == NULL)
+		return 0;
+	if (snap_add(s, key, p) == NULL) {
+		free(p);
+		return 0;
+	}
+	return 1;
+}
+
+/* read the boot registry of device, NULL if it has none */
+
+struct bootsnap *
+bootsnap_load (const char *device)
+{
+	struct bootsnap *s;
+	bootreg_data *hndl;
+	char key[64];
+	int i, n;
+
+	hndl = bootreg_init(device, BOOTREG_RDONLY, BOOTREG_LOG_NONE);
+	if (hndl == NULL)
+		return NULL;
+
+	s = calloc(1, sizeof(struct bootsnap));
+	if (s != NULL)
+		s->device = strdup(device);
+	if (s == NULL || s->device == NULL) {
+		free(s);
+		bootreg_deinit(&hndl);
+		return NULL;
+	}
+
+	for (i = 0; snap_keys[i] != NULL; i++)
+		snap_read(s, hndl, snap_keys[i]);
+	for (i = 0; snap_numbered[i] != NULL; i++) {
+		for (n = 0; n < SNAP_MAX_NUMBERED; n++) {
+			snprintf(key, sizeof(key), "%s%d", snap_numbered[i], n);
+			if (!snap_read(s, hndl, key))
+				break;
+		}
+	}
+
+	bootreg_deinit(&hndl);
+	return s;
+}
+
+/* value of key, NULL if it is not set. The value belongs to the
+ * snapshot. */
+
+const char *
+bootsnap_get (struct bootsnap *s, const char *key)
+{
+	struct bootsnap_entry *e;
+
+	if (s == NULL)
+		return NULL;
+	e = snap_find(s, key);
+	return e ? e->value : NULL;
+}
+
+/* set key to value in the snapshot, written by bootsnap_commit(). Returns
+ * 0 on success. */
+
+int
+bootsnap_set (struct bootsnap *s, const char *key, const char *value)
+{
+	struct bootsnap_entry *e;
+	char *v;
+
+	if (s == NULL)
+		return -1;
+	e = snap_find(s, key);
+	if (e != NULL && e->value != NULL && strcmp(e->value, value) == 0)
+		return 0;
+
+	v = strdup(value);
+	if (v == NULL)
+		return -1;
+	if (e == NULL) {
+		e = snap_add(s, key, v);
+		if (e == NULL) {
+			free(v);
+			return -1;
+		}
+	} else {
+		free(e->value);
+		e->value = v;
+	}
+	e->dirty = 1;
+
+	return 0;
+}
+
+/* write the keys changed since the last commit, the registry is only
+ * opened if there are any. Returns 0 on success. */
+
+int
+bootsnap_commit (struct bootsnap *s)
+{
+	bootreg_data *hndl;
+	int i, dirty = 0;
+
+	if (s == NULL)
+		return 0;
+	for (i = 0; i < s->count; i++)
+		dirty += s->ent[i].dirty;
+	if (dirty == 0)
+		return 0;
+
+	hndl = bootreg_init(s->device, BOOTREG_RDWR, BOOTREG_LOG_NONE);
+	if (hndl == NULL)
+		return -1;
+	for (i = 0; i < s->count; i++) {
+		if (!s->ent[i].dirty)
+			continue;
+		bootreg_set(hndl, s->ent[i].key, s->ent[i].value);
+		s->ent[i].dirty = 0;
+	}
+	bootreg_deinit(&hndl);
+
+	return 0;
+}
+
+/* free the snapshot, changes not committed are lost */
+
+void
+bootsnap_free (struct bootsnap *s)
+{
+	int i;
+
+	if (s == NULL)
+		return;
+	for (i = 0; i < s->count; i++) {
+		free(s->ent[i].key);
+		free(s->ent[i].value);
+	}
+	free(s->ent);
+	free(s->device);
+	free(s);
+}
@@ -0,0 +1,607 @@
+/*
+ * initramfs init program.
+ * generate modules.dep and modules.alias from the .modinfo sections of the
+ * module files, without running depmod.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <endian.h>
+#include <byteswap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "init.h"
+
+/* The module tree is described by a stamp, a hash over the path, size and
+ * mtime of every module file. The stamp of the tree the indexes were
+ * generated for is kept in modules.stamp, if it matches nothing is done.
+ *
+ * Of several files of a module name only one is indexed, like depmod's
+ * default search order a file below updates/ comes first, between files
+ * of the same rank the path which sorts first wins, readdir order does
+ * not matter. */
+
+#define DEPMOD_STAMP		"modules.stamp"
+#define DEPMOD_HASH_SIZE	1024	/* power of 2 */
+
+struct depmod_mod {
+	char			*relpath;	/* path below the module directory */
+	char			*name;		/* module name, '-' folded to '_' */
+	char			*info;		/* copy of the .modinfo section */
+	size_t			info_len;
+	int			visit;		/* dependency walk generation */
+	int			shadowed;	/* another file of the name wins */
+	struct depmod_mod	*hnext;		/* next module in same hash slot */
+};
+
+struct depmod_tree {
+	const char		*moddir;
+	struct depmod_mod	*mods;
+	int			count;
+	int			max;
+	unsigned int		stamp;
+	time_t			newest;		/* newest module mtime */
+	struct depmod_mod	*hash[DEPMOD_HASH_SIZE];
+};
+
+static unsigned int depmod_slot (const char *name)
+{
+	return hash_string(name, strlen(name)) & (DEPMOD_HASH_SIZE - 1);
+}
+
+static struct depmod_mod *depmod_find (struct depmod_tree *t, const char *name)
+{
+	struct depmod_mod *m;
+
+	for (m = t->hash[depmod_slot(name)]; m != NULL; m = m->hnext) {
+		if (strcmp(m->name, name) == 0)
+			return m;
+	}
+	return NULL;
+}
+
+/* add a module file, the hash is filled by depmod_insert() once the
+ * tree is complete */
+
+static void depmod_add (struct depmod_tree *t, const char *relpath, const struct stat *st)
+{
+	struct depmod_mod *m, *n;
+	const char *base = strrchr(relpath, '/');
+	size_t len, ext;
+	char *p;
+
+	t->stamp = t->stamp * 31 + hash_string(relpath, strlen(relpath));
+	t->stamp = t->stamp * 31 + (unsigned int) st->st_size;
+	t->stamp = t->stamp * 31 + (unsigned int) st->st_mtim.tv_sec;
+	t->stamp = t->stamp * 31 + (unsigned int) st->st_mtim.tv_nsec;
+	if (st->st_mtime > t->newest)
+		t->newest = st->st_mtime;
+
+	if (t->count == t->max) {
+		n = realloc(t->mods, (t->max + 256) * sizeof(struct depmod_mod));
+		if (n == NULL)
+			return;
+		t->mods = n;
+		t->max += 256;
+	}
+
+	base = base ? base + 1 : relpath;
+	len = strlen(base);
+	ext = module_ext_len(base, len);
+
+	m = &t->mods[t->count];
+	memset(m, 0, sizeof(struct depmod_mod));
+	m->relpath = strdup(relpath);
+	m->name = strndup(base, len - ext);
+	if (m->relpath == NULL || m->name == NULL) {
+		free(m->relpath);
+		free(m->name);
+		return;
+	}
+	for (p = m->name; *p; p++) {
+		if (*p == '-')
+			*p = '_';
+	}
+
+	t->count++;
+}
+
+static int depmod_rank (const struct depmod_mod *m)
+{
+	return strncmp(m->relpath, "updates/", 8) == 0 ? 0 : 1;
+}
+
+/* put m into the hash, if there is a module of the name already the one
+ * ranked first stays, the other one is shadowed */
+
+static void depmod_insert (struct depmod_tree *t, struct depmod_mod *m)
+{
+	struct depmod_mod **slot, *old;
+
+	for (slot = &t->hash[depmod_slot(m->name)]; *slot != NULL; slot = &(*slot)->hnext) {
+		old = *slot;
+		if (strcmp(old->name, m->name) != 0)
+			continue;
+		if (depmod_rank(m) < depmod_rank(old) ||
+		    (depmod_rank(m) == depmod_rank(old) && strcmp(m->relpath, old->relpath) < 0)) {
+			m->hnext = old->hnext;
+			*slot = m;
+			old->hnext = NULL;
+			old->shadowed = 1;
+		} else {
+			m->shadowed = 1;
+		}
+		return;
+	}
+	m->hnext = NULL;
+	*slot = m;
+}
+
+/* collect all module files below dir, relpath is the path of dir below
+ * the module directory */
+
+static void depmod_walk (struct depmod_tree *t, const char *relpath)
+{
+	char path[PATH_MAX], rel[PATH_MAX];
+	struct dirent *dent;
+	struct stat st;
+	const char *ext;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s%s%s", t->moddir, relpath[0] ? "/" : "", relpath);
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+		if (dent->d_type != DT_DIR && dent->d_type != DT_REG && dent->d_type != DT_UNKNOWN)
+			continue;
+
+		snprintf(rel, sizeof(rel), "%s%s%s", relpath, relpath[0] ? "/" : "", dent->d_name);
+		snprintf(path, sizeof(path), "%s/%s", t->moddir, rel);
+
+		if (dent->d_type == DT_DIR) {
+			depmod_walk(t, rel);
+			continue;
+		}
+
+		if (dent->d_type == DT_REG) {
+			ext = strchr(dent->d_name, '.');
+			if (ext == NULL || module_ext_len(ext, strlen(ext)) != strlen(ext))
+				continue;
+		}
+
+		/* the stamp needs size and mtime anyway */
+		if (stat(path, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			depmod_walk(t, rel);
+		} else if (S_ISREG(st.st_mode)) {
+			ext = strchr(dent->d_name, '.');
+			if (ext != NULL && module_ext_len(ext, strlen(ext)) == strlen(ext))
+				depmod_add(t, rel, &st);
+		}
+	}
+	closedir(dir);
+}
+
+static uint16_t elf16 (const unsigned char *p, int swap)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? bswap_16(v) : v;
+}
+
+static uint32_t elf32 (const unsigned char *p, int swap)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? bswap_32(v) : v;
+}
+
+static uint64_t elf64 (const unsigned char *p, int swap)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return swap ? bswap_64(v) : v;
+}
+
+/* find the .modinfo section of a module image, returns 0 on success */
+
+static int depmod_modinfo (const unsigned char *img, size_t len,
+			   size_t *info_off, size_t *info_len)
+{
+	uint64_t shoff, off, size, stroff, strsize;
+	unsigned int shentsize, shnum, shstrndx, i, name;
+	const unsigned char *sh;
+	int is64, swap;
+
+	if (len < EI_NIDENT || memcmp(img, ELFMAG, SELFMAG) != 0)
+		return -1;
+
+	is64 = (img[EI_CLASS] == ELFCLASS64);
+	if (!is64 && img[EI_CLASS] != ELFCLASS32)
+		return -1;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	swap = (img[EI_DATA] != ELFDATA2LSB);
+#else
+	swap = (img[EI_DATA] != ELFDATA2MSB);
+#endif
+
+	if (is64) {
+		if (len < sizeof(Elf64_Ehdr))
+			return -1;
+		shoff = elf64(img + offsetof(Elf64_Ehdr, e_shoff), swap);
+		shentsize = elf16(img + offsetof(Elf64_Ehdr, e_shentsize), swap);
+		shnum = elf16(img + offsetof(Elf64_Ehdr, e_shnum), swap);
+		shstrndx = elf16(img + offsetof(Elf64_Ehdr, e_shstrndx), swap);
+		if (shentsize < sizeof(Elf64_Shdr))
+			return -1;
+	} else {
+		if (len < sizeof(Elf32_Ehdr))
+			return -1;
+		shoff = elf32(img + offsetof(Elf32_Ehdr, e_shoff), swap);
+		shentsize = elf16(img + offsetof(Elf32_Ehdr, e_shentsize), swap);
+		shnum = elf16(img + offsetof(Elf32_Ehdr, e_shnum), swap);
+		shstrndx = elf16(img + offsetof(Elf32_Ehdr, e_shstrndx), swap);
+		if (shentsize < sizeof(Elf32_Shdr))
+			return -1;
+	}
+
+	if (shstrndx >= shnum || shoff > len || (uint64_t) shnum * shentsize > len - shoff)
+		return -1;
+
+#define SHDR(idx, field) (is64 ? \
+	elf64(img + shoff + (idx) * shentsize + offsetof(Elf64_Shdr, field), swap) : \
+	elf32(img + shoff + (idx) * shentsize + offsetof(Elf32_Shdr, field), swap))
+
+	stroff = SHDR(shstrndx, sh_offset);
+	strsize = SHDR(shstrndx, sh_size);
+	if (stroff > len || strsize > len - stroff)
+		return -1;
+
+	for (i = 0; i < shnum; i++) {
+		sh = img + shoff + i * shentsize;
+		name = elf32(sh + (is64 ? offsetof(Elf64_Shdr, sh_name) : offsetof(Elf32_Shdr, sh_name)), swap);
+		if (name + sizeof(".modinfo") > strsize ||
+		    memcmp(img + stroff + name, ".modinfo", sizeof(".modinfo")) != 0)
+			continue;
+
+		off = SHDR(i, sh_offset);
+		size = SHDR(i, sh_size);
+		if (off > len || size > len - off)
+			return -1;
+		*info_off = off;
+		*info_len = size;
+		return 0;
+	}
+#undef SHDR
+
+	return -1;
+}
+
+/* read the .modinfo section of a module, compressed modules are
+ * decompressed in memory, returns 0 on success */
+
+static int depmod_read (struct depmod_tree *t, struct depmod_mod *m)
+{
+	unsigned char *img = NULL;
+	size_t len = 0, size = 0, off, info_len;
+	char path[PATH_MAX];
+	struct stat st;
+	long rd;
+	int fd, mapped = 0, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s", t->moddir, m->relpath);
+
+	if (module_ext_len(m->relpath, strlen(m->relpath)) == 3) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			len = st.st_size;
+			img = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (img == MAP_FAILED)
+				img = NULL;
+			mapped = 1;
+		}
+		close(fd);
+	} else {
+		rd = read_module_image(path, &img, &size);
+		len = rd < 0 ? 0 : (size_t) rd;
+		if (rd < 0) {
+			free(img);
+			img = NULL;
+		}
+	}
+
+	if (img != NULL && depmod_modinfo(img, len, &off, &info_len) == 0) {
+		m->info = malloc(info_len + 1);
+		if (m->info != NULL) {
+			memcpy(m->info, img + off, info_len);
+			m->info[info_len] = '\0';
+			m->info_len = info_len;
+			ret = 0;
+		}
+	}
+
+	if (mapped && img != NULL)
+		munmap(img, len);
+	else if (!mapped)
+		free(img);
+
+	return ret;
+}
+
+/* the value of the next "key=" string of a .modinfo section, pos is the
+ * offset to continue at */
+
+static const char *depmod_info_next (const struct depmod_mod *m, const char *key, size_t *pos)
+{
+	size_t klen = strlen(key);
+	const char *s;
+
+	while (*pos < m->info_len) {
+		s = m->info + *pos;
+		*pos += strlen(s) + 1;
+		if (strncmp(s, key, klen) == 0 && s[klen] == '=')
+			return s + klen + 1;
+	}
+	return NULL;
+}
+
+/* append all (indirect) dependencies of m to the modules.dep line, a
+ * dependency is written after every module depending on it */
+
+static void depmod_deps (struct depmod_tree *t, struct depmod_mod *m, int gen,
+			 struct depmod_mod **order, int *count, int depth)
+{
+	const char *deps;
+	struct depmod_mod *d;
+	char name[NAME_MAX + 1], *p;
+	size_t pos = 0, len;
+
+	if (depth > 64)
+		return;
+
+	while ((deps = depmod_info_next(m, "depends", &pos)) != NULL) {
+		while (*deps) {
+			len = strcspn(deps, ",");
+			if (len > 0 && len < sizeof(name)) {
+				memcpy(name, deps, len);
+				name[len] = '\0';
+				for (p = name; *p; p++) {
+					if (*p == '-')
+						*p = '_';
+				}
+				d = depmod_find(t, name);
+				if (d != NULL && d->visit != gen) {
+					d->visit = gen;
+					depmod_deps(t, d, gen, order, count, depth + 1);
+					order[(*count)++] = d;
+				}
+			}
+			deps += len;
+			if (*deps == ',')
+				deps++;
+		}
+	}
+}
+
+static FILE *depmod_create (struct depmod_tree *t, const char *file, char *tmp, size_t len_tmp)
+{
+	snprintf(tmp, len_tmp, "%s/%s.tmp", t->moddir, file);
+	return fopen(tmp, "we");
+}
+
+static int depmod_commit (struct depmod_tree *t, FILE *f, const char *tmp, const char *file)
+{
+	char path[PATH_MAX];
+	int err;
+
+	err = ferror(f);
+	if (fclose(f) != 0 || err) {
+		unlink(tmp);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", t->moddir, file);
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	/* the binary index of the old file would be preferred */
+	snprintf(path, sizeof(path), "%s/%s.bin", t->moddir, file);
+	unlink(path);
+
+	return 0;
+}
+
+static int depmod_write (struct depmod_tree *t)
+{
+	struct depmod_mod **order;
+	char tmp[PATH_MAX];
+	const char *value;
+	size_t pos;
+	FILE *f;
+	int i, j, count;
+
+	order = malloc(t->count * sizeof(struct depmod_mod *));
+	if (order == NULL)
+		return -1;
+
+	f = depmod_create(t, "modules.dep", tmp, sizeof(tmp));
+	if (f == NULL) {
+		free(order);
+		return -1;
+	}
+	for (i = 0; i < t->count; i++) {
+		if (t->mods[i].shadowed)
+			continue;
+		count = 0;
+		t->mods[i].visit = i + 1;
+		depmod_deps(t, &t->mods[i], i + 1, order, &count, 0);
+
+		fprintf(f, "%s:", t->mods[i].relpath);
+		/* depmod lists the modules in the reverse load order */
+		for (j = count - 1; j >= 0; j--)
+			fprintf(f, " %s", order[j]->relpath);
+		fputc('\n', f);
+	}
+	free(order);
+	if (depmod_commit(t, f, tmp, "modules.dep") != 0)
+		return -1;
+
+	f = depmod_create(t, "modules.alias", tmp, sizeof(tmp));
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# Aliases extracted from modules themselves.\n");
+	for (i = 0; i < t->count; i++) {
+		if (t->mods[i].shadowed)
+			continue;
+		pos = 0;
+		while ((value = depmod_info_next(&t->mods[i], "alias", &pos)) != NULL)
+			fprintf(f, "alias %s %s\n", value, t->mods[i].name);
+	}
+	if (depmod_commit(t, f, tmp, "modules.alias") != 0)
+		return -1;
+
+	f = depmod_create(t, "modules.softdep", tmp, sizeof(tmp));
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# Soft dependencies extracted from modules themselves.\n");
+	for (i = 0; i < t->count; i++) {
+		if (t->mods[i].shadowed)
+			continue;
+		pos = 0;
+		while ((value = depmod_info_next(&t->mods[i], "softdep", &pos)) != NULL)
+			fprintf(f, "softdep %s %s\n", t->mods[i].name, value);
+	}
+	return depmod_commit(t, f, tmp, "modules.softdep");
+}
+
+static void depmod_free (struct depmod_tree *t)
+{
+	int i;
+
+	for (i = 0; i < t->count; i++) {
+		free(t->mods[i].relpath);
+		free(t->mods[i].name);
+		free(t->mods[i].info);
+	}
+	free(t->mods);
+}
+
+/* returns 1 if the indexes in the module directory describe the tree */
+
+static int depmod_uptodate (struct depmod_tree *t, const char *stamp)
+{
+	char buf[16], path[PATH_MAX];
+	struct stat st;
+
+	if (file_exists("%s/modules.alias", t->moddir) != 1)
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/modules.dep", t->moddir);
+	if (stat(path, &st) != 0)
+		return 0;
+
+	if (read_file(8, buf, sizeof(buf), "%s/%s", t->moddir, DEPMOD_STAMP) != NULL)
+		return (strcmp(buf, stamp) == 0);
+
+	/* no stamp: indexes generated when the initramfs was built are
+	   trusted as long as they are newer than every module */
+	return (st.st_mtime >= t->newest);
+}
+
+/* bring modules.dep and modules.alias of the module directory up to date,
+ * returns 0 on success */
+
+int
+depmod_update (init_t *init)
+{
+	struct depmod_tree tree;
+	char stamp[16];
+	int i, fd, failed = 0, ret;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.moddir = init->moddir;
+	depmod_walk(&tree, "");
+	if (tree.count == 0) {
+		depmod_free(&tree);
+		return 0;
+	}
+	snprintf(stamp, sizeof(stamp), "%08x", tree.stamp);
+
+	if (depmod_uptodate(&tree, stamp)) {
+		msg(init,LOG_INFO,"depmod: module dependencies are up to date\n");
+		ret = 0;
+		goto out;
+	}
+
+	msg(init,LOG_NOTICE," * reconfigure kernel module dependencies\n");
+
+	for (i = 0; i < tree.count; i++)
+		depmod_insert(&tree, &tree.mods[i]);
+	for (i = 0; i < tree.count; i++) {
+		if (tree.mods[i].shadowed)
+			continue;
+		if (depmod_read(&tree, &tree.mods[i]) != 0) {
+			msg(init,LOG_ERR,"depmod: can not read %s\n", tree.mods[i].relpath);
+			failed++;
+		}
+	}
+	/* indexes without the unreadable modules would resolve worse than
+	   the ones we have */
+	if (failed) {
+		msg(init,LOG_ERR,"depmod: keeping the module indexes\n");
+		ret = -1;
+	} else {
+		ret = depmod_write(&tree);
+		if (ret != 0)
+			msg(init,LOG_ERR,"depmod: can not write the module indexes to %s\n", init->moddir);
+	}
+
+	/* the stamp is only written after a complete pass, the tree is
+	   checked again next time otherwise */
+	if (ret == 0) {
+		fd = open_file_write_only("%s/%s", init->moddir, DEPMOD_STAMP);
+		if (fd >= 0) {
+			iwrite(fd, (unsigned char *) stamp, strlen(stamp));
+			close(fd);
+		}
+	}
+
+out:
+	depmod_free(&tree);
+	return ret;
+}
@@ -0,0 +1,185 @@
+/*
+ * initramfs init program.
+ * bring the device nodes devtmpfs created in line with our /dev layout.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "init.h"
+
+/* /dev is a devtmpfs, the kernel creates the nodes itself. A node which
+ * exists is trusted, only the nodes of the devices our layout names
+ * differently are created (misc devices devtmpfs puts into a
+ * subdirectory, e.g. /dev/tun next to /dev/net/tun), and the owner and
+ * mode of the igf* nodes are set to root:disk 0660.
+ * /dev is checked before sysfs, the dev attribute is only read for nodes
+ * which have to be created. */
+
+struct devnode_class {
+	const char	*sysdir;
+	mode_t		type;
+	const char	*devdir;	/* subdirectory of /dev or NULL */
+	gid_t		group;
+	const char	*fix_prefix;	/* existing nodes get group and mode */
+};
+
+static const struct devnode_class devnode_classes[] = {
+	{ "/sys/class/block",		S_IFBLK, NULL,    6,   "igf" },	/* gid=disk */
+	{ "/sys/devices/virtual/tty",	S_IFCHR, NULL,    100, NULL },	/* gid=users */
+	{ "/sys/devices/virtual/mem",	S_IFCHR, NULL,    0,   NULL },
+	{ "/sys/devices/virtual/misc",	S_IFCHR, NULL,    0,   NULL },
+	{ "/sys/devices/virtual/input",	S_IFCHR, "input", 0,   NULL },
+	{ "/sys/devices/virtual/vc",	S_IFCHR, NULL,    0,   NULL },
+};
+#define N_DEVNODE_CLASSES	(sizeof(devnode_classes) / sizeof(devnode_classes[0]))
+
+#define DEVNODE_MODE		(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+
+/* major:minor from the dev attribute of sysfs entry name, -1 if it has
+ * none */
+
+static int devnode_devt (int sysfd, const char *name, dev_t *devt)
+{
+	char path[NAME_MAX + 8], buf[32], *end;
+	unsigned long major, minor;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/dev", name);
+	fd = openat(sysfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	major = strtoul(buf, &end, 10);
+	if (end == buf || *end != ':')
+		return -1;
+	minor = strtoul(end + 1, &end, 10);
+	if (*end != '\n' && *end != '\0')
+		return -1;
+
+	*devt = makedev(major, minor);
+	return 0;
+}
+
+static void devnode_reconcile_class (init_t *init, int devfd, const struct devnode_class *c,
+				     int *created, int *fixed)
+{
+	struct dirent *dent;
+	struct stat st;
+	dev_t devt;
+	DIR *dir;
+	int sysfd, dfd;
+
+	sysfd = open(c->sysdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sysfd < 0)
+		return;
+
+	if (c->devdir) {
+		if (mkdirat(devfd, c->devdir, 0755) != 0 && errno != EEXIST) {
+			close(sysfd);
+			return;
+		}
+		dfd = openat(devfd, c->devdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		dfd = dup(devfd);
+	}
+	if (dfd < 0) {
+		close(sysfd);
+		return;
+	}
+
+	/* fdopendir takes over sysfd */
+	dir = fdopendir(sysfd);
+	if (dir == NULL) {
+		close(sysfd);
+		close(dfd);
+		return;
+	}
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+		/* class entries are links, the virtual devices directories */
+		if (dent->d_type != DT_LNK && dent->d_type != DT_DIR &&
+		    dent->d_type != DT_UNKNOWN)
+			continue;
+
+		if (fstatat(dfd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			if (c->fix_prefix == NULL ||
+			    strncmp(dent->d_name, c->fix_prefix, strlen(c->fix_prefix)) != 0 ||
+			    (st.st_mode & S_IFMT) != c->type)
+				continue;
+			if (st.st_uid == 0 && st.st_gid == c->group &&
+			    (st.st_mode & 07777) == DEVNODE_MODE)
+				continue;
+			if (fchownat(dfd, dent->d_name, 0, c->group, AT_SYMLINK_NOFOLLOW) == 0 &&
+			    fchmodat(dfd, dent->d_name, DEVNODE_MODE, 0) == 0)
+				(*fixed)++;
+			continue;
+		}
+
+		if (devnode_devt(dirfd(dir), dent->d_name, &devt) != 0)
+			continue;
+		if (mknodat(dfd, dent->d_name, c->type | DEVNODE_MODE, devt) != 0)
+			continue;
+		/* the mode given to mknod is masked by the umask */
+		if (fchownat(dfd, dent->d_name, 0, c->group, AT_SYMLINK_NOFOLLOW) != 0 ||
+		    fchmodat(dfd, dent->d_name, DEVNODE_MODE, 0) != 0)
+			msg(init,LOG_ERR,"devnodes: can not set the owner of %s\n",
+			    dent->d_name);
+		(*created)++;
+	}
+
+	closedir(dir);
+	close(dfd);
+}
+
+/* one pass over the device classes init cares about */
+
+void
+reconcile_devices (init_t *init)
+{
+	unsigned int i;
+	int devfd, created = 0, fixed = 0;
+
+	devfd = open("/dev", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (devfd < 0) {
+		msg(init,LOG_ERR,"devnodes: can not open /dev\n");
+		return;
+	}
+
+	for (i = 0; i < N_DEVNODE_CLASSES; i++)
+		devnode_reconcile_class(init, devfd, &devnode_classes[i], &created, &fixed);
+
+	close(devfd);
+
+	if (created || fixed)
+		msg(init,LOG_INFO,"devnodes: %d created, %d fixed\n", created, fixed);
+}
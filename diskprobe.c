@@ -0,0 +1,399 @@
+/*
+ * initramfs init program.
+ * read the partition data of all disks in parallel.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <igel64/igel.h>
+#include "init.h"
+
+/* Checking a disk for the boot device is sequential, it works on init and
+ * on fixed device nodes. What makes it slow is reading from the disks, a
+ * USB stick takes much longer to answer than a NVMe drive. So one thread
+ * per disk reads the partition table and the IGEL signatures, and for the
+ * partitions which carry them the areas the boot registry check reads,
+ * which leaves them in the page cache.
+ * The caller waits only for the disk it checks next, the disks are
+ * checked in the same order as before.
+ *
+ * One set lives as long as the search for the boot device. Every round
+ * (diskprobe_start()) looks at /sys/block again: a disk keeps a probe
+ * which read its partition table, is probed again if that failed or the
+ * device number changed, and does not get another probe while the one
+ * from an earlier round still hangs on it. A disk whose probe did not
+ * finish in time is read by the caller, in its place in the order.
+ * diskprobe_close() waits a while for the probes still running before
+ * the disks are used for booting.
+ *
+ * The threads are detached, the set is freed when the caller and all
+ * threads dropped their reference. Disks beyond DISKPROBE_MAX probes are
+ * read by the caller. */
+
+#define DISKPROBE_MAX		32
+#define DISKPROBE_WAIT		1000	/* ms for a probe of this round */
+#define DISKPROBE_DRAIN		3000	/* ms for the probes still running */
+
+struct disk_probe {
+	char			name[32];	/* empty: slot unused */
+	char			dev[16];	/* major:minor of the probe */
+	const char		*part_prefix;
+	int			ret;		/* read_partition_table() */
+	int			done;
+	int			busy;		/* thread running */
+	int			seen;		/* in the current round */
+	struct disk_parts	parts;
+	struct disk_probe_set	*set;
+};
+
+struct disk_round {
+	char			name[32];
+	int			rank;
+	int			slot;		/* -1: no probe */
+	int			stale;		/* probe of an earlier round */
+};
+
+struct disk_probe_set {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			refs;
+	struct disk_probe	disk[DISKPROBE_MAX];
+	/* the current round, only used by the caller */
+	struct disk_round	*order;
+	int			count;
+	int			max;
+};
+
+static void diskprobe_put (struct disk_probe_set *set)
+{
+	int refs;
+
+	pthread_mutex_lock(&set->lock);
+	refs = --set->refs;
+	pthread_mutex_unlock(&set->lock);
+
+	if (refs == 0) {
+		pthread_mutex_destroy(&set->lock);
+		pthread_cond_destroy(&set->cond);
+		free(set);
+	}
+}
+
+static void diskprobe_deadline (struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* read the start of the boot registry and the partition directory */
+
+static void diskprobe_prefetch (struct disk_probe *d, int part)
+{
+	static const struct {
+		off_t	offset;
+		size_t	len;
+	} area[] = {
+		{ IGEL_BOOTREG_OFFSET, IGEL_BOOTREG_SIZE },
+		{ DIR_OFFSET, 4096 },
+	};
+	char name[64];
+	unsigned char *buf;
+	unsigned int i;
+	int fd;
+
+	snprintf(name, sizeof(name), "/dev/%s%s%d", d->name, d->part_prefix, part);
+	fd = open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	buf = malloc(IGEL_BOOTREG_SIZE);
+	for (i = 0; buf != NULL && i < sizeof(area) / sizeof(area[0]); i++) {
+		if ((uint64_t) (area[i].offset + area[i].len) > d->parts.size[part - 1])
+			continue;
+		if (pread(fd, buf, area[i].len, area[i].offset) < 0)
+			break;
+	}
+	free(buf);
+	close(fd);
+}
+
+static void *diskprobe_thread (void *arg)
+{
+	struct disk_probe *d = arg;
+	struct disk_probe_set *set = d->set;
+	int i, ret;
+
+	ret = read_partition_table(d->name, &d->parts);
+	if (ret == 0) {
+		read_igel_signatures(d->name, &d->parts);
+		for (i = 1; i <= MAX_PART_NUM; i++) {
+			if (d->parts.size[i - 1] == 0)
+				continue;
+			if (d->parts.have_igel && !d->parts.igel[i - 1])
+				continue;
+			diskprobe_prefetch(d, i);
+		}
+	}
+
+	pthread_mutex_lock(&set->lock);
+	d->ret = ret;
+	d->done = 1;
+	d->busy = 0;
+	pthread_cond_broadcast(&set->cond);
+	pthread_mutex_unlock(&set->lock);
+
+	diskprobe_put(set);
+	return NULL;
+}
+
+/* an empty set, NULL if there is no memory */
+
+struct disk_probe_set *
+diskprobe_open (void)
+{
+	struct disk_probe_set *set;
+	pthread_condattr_t attr;
+
+	set = calloc(1, sizeof(struct disk_probe_set));
+	if (set == NULL)
+		return NULL;
+
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&set->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	set->refs = 1;
+
+	return set;
+}
+
+/* start the probe of slot d for the disk name, called with the lock held */
+
+static void diskprobe_run (struct disk_probe_set *set, struct disk_probe *d,
+			   const char *name, const char *dev)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	strcpy(d->name, name);
+	strcpy(d->dev, dev);
+	d->part_prefix = (strncmp(d->name, "mmcblk", 6) == 0 ||
+			  strncmp(d->name, "nvme", 4) == 0) ? "p" : "";
+	d->set = set;
+	d->ret = -1;
+	d->done = 0;
+	d->busy = 1;
+	set->refs++;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, diskprobe_thread, d) != 0) {
+		/* the caller reads the disk itself */
+		set->refs--;
+		d->busy = 0;
+		d->done = 1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* a new round over the entries of /sys/block for which check returns 1,
+ * ordered by rank (lowest first, readdir order within a rank) if rank is
+ * not NULL. Returns the number of disks of the round. */
+
+int
+diskprobe_start (struct disk_probe_set *set, int (*check)(const char *name),
+		 int (*rank)(const char *name))
+{
+	struct disk_round *r, *n;
+	struct disk_probe *d;
+	struct dirent *dent;
+	char devbuf[32], dev[16], *p;
+	DIR *dir;
+	int i, j;
+
+	set->count = 0;
+	dir = opendir("/sys/block");
+	if (dir == NULL)
+		return 0;
+	for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
+		if (dent->d_name[0] == '.' || strlen(dent->d_name) >= sizeof(r->name))
+			continue;
+		if (!check(dent->d_name))
+			continue;
+		if (set->count == set->max) {
+			n = realloc(set->order, (set->max + 16) * sizeof(struct disk_round));
+			if (n == NULL)
+				break;
+			set->order = n;
+			set->max += 16;
+		}
+		r = &set->order[set->count++];
+		strcpy(r->name, dent->d_name);
+		r->rank = rank ? rank(r->name) : 0;
+		r->slot = -1;
+		r->stale = 0;
+	}
+	closedir(dir);
+
+	/* stable insertion sort, there are only a few disks */
+	for (i = 1; i < set->count; i++) {
+		struct disk_round tmp = set->order[i];
+
+		for (j = i; j > 0 && set->order[j - 1].rank > tmp.rank; j--)
+			set->order[j] = set->order[j - 1];
+		set->order[j] = tmp;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	for (i = 0; i < DISKPROBE_MAX; i++)
+		set->disk[i].seen = 0;
+
+	for (i = 0; i < set->count; i++) {
+		r = &set->order[i];
+
+		p = read_file(sizeof(devbuf) - 1, devbuf, sizeof(devbuf),
+			      "/sys/block/%s/dev", r->name);
+		snprintf(dev, sizeof(dev), "%s", p ? p : "");
+		dev[strcspn(dev, "\n")] = '\0';
+
+		for (j = 0; j < DISKPROBE_MAX; j++) {
+			if (strcmp(set->disk[j].name, r->name) == 0)
+				break;
+		}
+		if (j == DISKPROBE_MAX) {
+			/* a free slot, one of a disk which is gone at the latest */
+			for (j = 0; j < DISKPROBE_MAX; j++) {
+				if (set->disk[j].name[0] == '\0' && !set->disk[j].busy)
+					break;
+			}
+			if (j == DISKPROBE_MAX)
+				continue;
+		}
+
+		d = &set->disk[j];
+		d->seen = 1;
+		r->slot = j;
+		if (d->busy) {
+			/* still hanging on the disk, it is not waited for */
+			r->stale = 1;
+			continue;
+		}
+		if (d->name[0] != '\0' && d->done && d->ret == 0 && strcmp(d->dev, dev) == 0)
+			continue;
+		diskprobe_run(set, d, r->name, dev);
+	}
+
+	/* slots of disks which are gone are free once their probe ended */
+	for (i = 0; i < DISKPROBE_MAX; i++) {
+		if (!set->disk[i].seen && !set->disk[i].busy)
+			set->disk[i].name[0] = '\0';
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	return set->count;
+}
+
+int
+diskprobe_count (struct disk_probe_set *set)
+{
+	return set->count;
+}
+
+/* name of the i-th disk of the round */
+
+const char *
+diskprobe_name (struct disk_probe_set *set, int i)
+{
+	return set->order[i].name;
+}
+
+/* wait for the probe of the i-th disk of the round, returns its name and
+ * fills parts if its partition table was read (*have_parts set to 1).
+ * Returns NULL if the probe did not finish in time, the caller reads the
+ * disk itself then. */
+
+const char *
+diskprobe_wait (struct disk_probe_set *set, int i, struct disk_parts *parts,
+		int *have_parts)
+{
+	struct disk_round *r = &set->order[i];
+	struct disk_probe *d;
+	struct timespec ts;
+	int done, rc = 0;
+
+	*have_parts = 0;
+	if (r->slot < 0)
+		return r->name;
+	d = &set->disk[r->slot];
+
+	diskprobe_deadline(&ts, r->stale ? 0 : DISKPROBE_WAIT);
+	pthread_mutex_lock(&set->lock);
+	while (!d->done && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&set->cond, &set->lock, &ts);
+	done = d->done;
+	if (done && d->ret == 0) {
+		memcpy(parts, &d->parts, sizeof(struct disk_parts));
+		*have_parts = 1;
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	return done ? r->name : NULL;
+}
+
+/* wait up to DISKPROBE_DRAIN ms for the probes still running and drop
+ * the reference of the caller. Returns the number of probes which did
+ * not finish, they end on their own. */
+
+int
+diskprobe_close (struct disk_probe_set *set)
+{
+	struct timespec ts;
+	int i, busy, rc = 0;
+
+	if (set == NULL)
+		return 0;
+
+	diskprobe_deadline(&ts, DISKPROBE_DRAIN);
+	pthread_mutex_lock(&set->lock);
+	do {
+		for (i = 0, busy = 0; i < DISKPROBE_MAX; i++)
+			busy += set->disk[i].busy;
+		if (busy > 0)
+			rc = pthread_cond_timedwait(&set->cond, &set->lock, &ts);
+	} while (busy > 0 && rc != ETIMEDOUT);
+	pthread_mutex_unlock(&set->lock);
+
+	free(set->order);
+	set->order = NULL;
+	diskprobe_put(set);
+
+	return busy;
+}
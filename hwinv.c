@@ -0,0 +1,299 @@
+/*
+ * initramfs init program.
+ * inventory of the DMI data and the PCI and USB devices.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "init.h"
+
+/* The DMI fields and the PCI devices are read once, on the first query
+ * or by hwinv_collect() early in main(), and kept sorted for bsearch().
+ * USB devices only show up once the host controller drivers are loaded,
+ * they are read by hwinv_export(), which writes everything to HWINV_FILE
+ * for the real root:
+ *
+ *   dmi sys_vendor=LENOVO
+ *   pci 8086:9a49 030000
+ *   usb 046d:c52b
+ */
+
+#define HWINV_FILE	"/dev/.initramfs.hwinv"
+
+static const char *dmi_fields[] = {
+	"sys_vendor", "product_name", "product_version", "board_vendor",
+	"board_name", "bios_vendor", "bios_version", NULL
+};
+#define N_DMI_FIELDS	(sizeof(dmi_fields) / sizeof(dmi_fields[0]) - 1)
+
+static char *dmi_values[N_DMI_FIELDS];
+static struct hwinv_pci *pci_devs = NULL;
+static int pci_count = 0;
+static struct hwinv_usb *usb_devs = NULL;
+static int usb_count = 0;
+static pthread_once_t hwinv_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_pci (const void *a, const void *b)
+{
+	const struct hwinv_pci *pa = a, *pb = b;
+
+	if (pa->vendor != pb->vendor)
+		return pa->vendor < pb->vendor ? -1 : 1;
+	if (pa->device != pb->device)
+		return pa->device < pb->device ? -1 : 1;
+	return 0;
+}
+
+static int cmp_usb (const void *a, const void *b)
+{
+	const struct hwinv_usb *ua = a, *ub = b;
+
+	if (ua->vendor != ub->vendor)
+		return ua->vendor < ub->vendor ? -1 : 1;
+	if (ua->product != ub->product)
+		return ua->product < ub->product ? -1 : 1;
+	return 0;
+}
+
+/* hex value of a sysfs attribute, -1 if it can not be read */
+
+static long read_hex (const char *bus, const char *dev, const char *attr)
+{
+	char buf[32], *p, *end;
+	long value;
+
+	p = read_file(sizeof(buf) - 1, buf, sizeof(buf), "/sys/bus/%s/devices/%s/%s",
+		      bus, dev, attr);
+	if (p == NULL)
+		return -1;
+	value = strtol(p, &end, 16);
+	if (end == p)
+		return -1;
+	return value;
+}
+
+static void hwinv_pci_scan (void)
+{
+	struct hwinv_pci *n;
+	struct dirent *dent;
+	long vendor, device, class;
+	int max = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/bus/pci/devices");
+	if (dir == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+		vendor = read_hex("pci", dent->d_name, "vendor");
+		device = read_hex("pci", dent->d_name, "device");
+		class = read_hex("pci", dent->d_name, "class");
+		if (vendor < 0 || device < 0)
+			continue;
+		if (pci_count == max) {
+			n = realloc(pci_devs, (max + 32) * sizeof(struct hwinv_pci));
+			if (n == NULL)
+				break;
+			pci_devs = n;
+			max += 32;
+		}
+		pci_devs[pci_count].vendor = vendor;
+		pci_devs[pci_count].device = device;
+		pci_devs[pci_count].class = class < 0 ? 0 : class;
+		pci_count++;
+	}
+	closedir(dir);
+
+	qsort(pci_devs, pci_count, sizeof(struct hwinv_pci), cmp_pci);
+}
+
+static void hwinv_scan (void)
+{
+	char buf[256];
+	unsigned int i;
+
+	for (i = 0; i < N_DMI_FIELDS; i++) {
+		if (get_dmi_data(dmi_fields[i], buf, sizeof(buf)) != NULL)
+			dmi_values[i] = strdup(buf);
+	}
+	hwinv_pci_scan();
+}
+
+/* read the inventory, does nothing if it was read already */
+
+void
+hwinv_collect (void)
+{
+	pthread_once(&hwinv_once, hwinv_scan);
+}
+
+/* read the USB devices again, the ids of devices which were removed
+ * are dropped */
+
+void
+hwinv_usb_scan (void)
+{
+	struct hwinv_usb *devs = NULL, *n;
+	struct dirent *dent;
+	long vendor, product;
+	int count = 0, max = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/bus/usb/devices");
+	if (dir == NULL)
+		return;
+	while ((dent = readdir(dir)) != NULL) {
+		/* interfaces have no ids */
+		if (dent->d_name[0] == '.' || strchr(dent->d_name, ':') != NULL)
+			continue;
+		vendor = read_hex("usb", dent->d_name, "idVendor");
+		product = read_hex("usb", dent->d_name, "idProduct");
+		if (vendor < 0 || product < 0)
+			continue;
+		if (count == max) {
+			n = realloc(devs, (max + 32) * sizeof(struct hwinv_usb));
+			if (n == NULL)
+				break;
+			devs = n;
+			max += 32;
+		}
+		devs[count].vendor = vendor;
+		devs[count].product = product;
+		count++;
+	}
+	closedir(dir);
+
+	qsort(devs, count, sizeof(struct hwinv_usb), cmp_usb);
+
+	pthread_mutex_lock(&usb_lock);
+	n = usb_devs;
+	usb_devs = devs;
+	usb_count = count;
+	pthread_mutex_unlock(&usb_lock);
+	free(n);
+}
+
+/* DMI field copied to buffer, like get_dmi_data(), which is used for the
+ * fields not in the inventory */
+
+char *
+hwinv_dmi (const char *field, char *buffer, size_t len_buf)
+{
+	unsigned int i;
+
+	hwinv_collect();
+	for (i = 0; i < N_DMI_FIELDS; i++) {
+		if (strcmp(dmi_fields[i], field) != 0)
+			continue;
+		if (dmi_values[i] == NULL || len_buf == 0)
+			return NULL;
+		strncpy(buffer, dmi_values[i], len_buf - 1);
+		buffer[len_buf - 1] = '\0';
+		return buffer;
+	}
+
+	return get_dmi_data(field, buffer, len_buf);
+}
+
+/* returns 1 if there is a PCI device of vendor */
+
+int
+hwinv_has_pci_vendor (unsigned int vendor)
+{
+	int lo = 0, hi, mid;
+
+	hwinv_collect();
+
+	/* first entry with vendor or above */
+	hi = pci_count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (pci_devs[mid].vendor < vendor)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < pci_count && pci_devs[lo].vendor == vendor);
+}
+
+/* the PCI devices, sorted by vendor and device */
+
+const struct hwinv_pci *
+hwinv_pci_devices (int *count)
+{
+	hwinv_collect();
+	*count = pci_count;
+	return pci_devs;
+}
+
+/* write the inventory to HWINV_FILE, returns 0 on success */
+
+int
+hwinv_export (void)
+{
+	char line[320];
+	unsigned int i;
+	int fd, len, err = 0;
+
+	hwinv_collect();
+	hwinv_usb_scan();
+
+	fd = open(HWINV_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < N_DMI_FIELDS; i++) {
+		if (dmi_values[i] == NULL)
+			continue;
+		len = snprintf(line, sizeof(line), "dmi %s=%s\n", dmi_fields[i], dmi_values[i]);
+		if (len >= (int) sizeof(line))
+			len = sizeof(line) - 1;
+		if (iwrite(fd, (unsigned char *) line, len) != len)
+			err = 1;
+	}
+	for (i = 0; i < (unsigned int) pci_count; i++) {
+		len = snprintf(line, sizeof(line), "pci %04x:%04x %06x\n", pci_devs[i].vendor,
+			       pci_devs[i].device, pci_devs[i].class);
+		if (iwrite(fd, (unsigned char *) line, len) != len)
+			err = 1;
+	}
+	pthread_mutex_lock(&usb_lock);
+	for (i = 0; i < (unsigned int) usb_count; i++) {
+		len = snprintf(line, sizeof(line), "usb %04x:%04x\n", usb_devs[i].vendor,
+			       usb_devs[i].product);
+		if (iwrite(fd, (unsigned char *) line, len) != len)
+			err = 1;
+	}
+	pthread_mutex_unlock(&usb_lock);
+	close(fd);
+
+	if (err || rename(HWINV_FILE ".tmp", HWINV_FILE) != 0) {
+		unlink(HWINV_FILE ".tmp");
+		return -1;
+	}
+
+	return 0;
+}
@@ -42,6 +42,7 @@
 #include <libgen.h>
 #include <sys/ioctl.h>
 #include <linux/loop.h>
+#include <pthread.h>
 #include "init.h"
 #include <sys/stat.h>
 #include <dirent.h>
@@ -112,6 +113,7 @@ print_init(init_t *init)
 	msg(init,LOG_NOTICE,"   splash = %d\n",init->splash);
 	msg(init,LOG_NOTICE,"   verbose = %d\n",init->verbose);
 	msg(init,LOG_NOTICE,"   failsafe = %d\n", init->failsafe);
+	msg(init,LOG_NOTICE,"   coldplug = %s\n", init->coldplug_storage ? "storage" : "all");
 	if (init->initcmd) {
 		msg(init,LOG_NOTICE,"   initcmd = %s %d\n",init->initcmd,init->runlevel);
 	}
@@ -279,71 +281,244 @@ prepare_filesystem(void)
 	}
 }
 
-/* check if a kernel module is already loaded */
-/* return 1 = loaded, 0 = not loaded, -1 = can't tell */
-int 
-kmodule_already_loaded (init_t *init, const char *name)
+/* module state cache
+ *
+ * Builtin modules (modules.builtin) and the modules in /proc/modules are
+ * read once into a set of normalized module names ('-' folded to '_').
+ * insmod_cmd()/rmmod_cmd() update the set, modules which failed to load or
+ * have no module file are remembered too. Names not in the set are checked
+ * with a single stat of /sys/module/<name>, which also catches modules
+ * loaded behind our back. */
+
+#define KMOD_STATE_HASH_SIZE	512	/* power of 2 */
+
+struct kmod_state {
+	struct kmod_state	*next;
+	int			state;
+	char			name[];
+};
+
+static struct kmod_state *kmod_states[KMOD_STATE_HASH_SIZE];
+static int kmod_states_ready = 0;
+static pthread_mutex_t kmod_states_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* modules.builtin.bin, used if there is no modules.builtin */
+static struct bin_index *builtin_bin = NULL;
+
+/* normalize a module name or module file path, returns the key length */
+
+static size_t kmod_state_key (char *key, const char *name, size_t len_key)
 {
-	int fd, len;
-	char *p, *s;
+	const char *p = strrchr(name, '/');
+	size_t i;
 
-	/* check if this is a kernel built in (/sys/module/name directory exists) */
+	if (p)
+		name = p + 1;
 
-	if (file_exists("/sys/module/%s", name) == 1) {
-		return 1;
+	for (i = 0; i + 1 < len_key && name[i] != '\0' && name[i] != '.'; i++)
+		key[i] = (name[i] == '-') ? '_' : name[i];
+	key[i] = '\0';
+
+	return i;
+}
+
+/* lookup a normalized name, kmod_states_lock has to be held */
+
+static struct kmod_state **kmod_state_slot (const char *key, size_t len)
+{
+	struct kmod_state **slot;
+
+	slot = &kmod_states[hash_string(key, len) & (KMOD_STATE_HASH_SIZE - 1)];
+	for (; *slot != NULL; slot = &(*slot)->next) {
+		if (strcmp((*slot)->name, key) == 0)
+			break;
 	}
 
-	if (asprintf(&s,"/%s.ko", name) >= 0 && s != NULL) {
-		if (!init) {
-			struct utsname un;
-			if (uname(&un) == 0) {
-				if (grep_kernel_module_in_file(s, "/lib/modules/%s/modules.builtin",un.release) == 1) {
-					return 1;
-				}
-			}
-		} else {
-			if (grep_kernel_module_in_file(s, "%s/modules.builtin", init->moddir) == 1) {
-				return 1;
-			}
+	return slot;
+}
+
+static void kmod_state_store (const char *key, size_t len, int state)
+{
+	struct kmod_state **slot, *entry;
+
+	slot = kmod_state_slot(key, len);
+	if (*slot != NULL) {
+		if (state == KMOD_STATE_UNLOADED) {
+			entry = *slot;
+			*slot = entry->next;
+			free(entry);
+		} else if ((*slot)->state != KMOD_STATE_BUILTIN) {
+			(*slot)->state = state;
 		}
-		free(s);
+		return;
 	}
 
-	fd = open ("/proc/modules", O_RDONLY);
-	if (fd < 0)
-		return -1;
-	
-	while ((len = iread (fd, (unsigned char *)buffer, sizeof(buffer)))) {
-		char *start=&buffer[0];
-		buffer[len] = '\0';
-		
-		/* next space is the end of module name */
-		p = strchr (start, ' ');
-		while (p) {
-			*p = '\0';
-			
-			/* match_module() is a strcmp, except that
-			   '-' and '_' are equivalent */
-			if (match_module(name, start) == 0) {
-				close (fd);
-				return 1;
+	if (state == KMOD_STATE_UNLOADED)
+		return;
+
+	entry = malloc(sizeof(struct kmod_state) + len + 1);
+	if (entry == NULL)
+		return;
+	memcpy(entry->name, key, len + 1);
+	entry->state = state;
+	entry->next = *slot;
+	*slot = entry;
+}
+
+/* add every module name of a file with one module (path) per line,
+ * the name ends with the first blank */
+
+static int kmod_state_read (int fd, int state)
+{
+	char *data = NULL, *n, *line, *end, key[NAME_MAX + 1];
+	size_t size = 0, len = 0;
+	ssize_t rd;
+
+	for (;;) {
+		if (len == size) {
+			/* /proc files report size 0, so grow while reading */
+			n = realloc(data, size + 16384 + 1);
+			if (n == NULL) {
+				free(data);
+				return -1;
 			}
-			
-			/* goto next newline */
-			if (! (*(p+1))) break;
-			p = strchr (p+1, '\n');
-			if (! (*(p+1))) break;
-			start = p+1;
-			
-			/* next space is the end of module name */
-			p = strchr (start, ' ');
+			data = n;
+			size += 16384;
 		}
+		rd = iread(fd, (unsigned char *) data + len, size - len);
+		if (rd <= 0)
+			break;
+		len += rd;
 	}
+	data[len] = '\0';
 
-	close (fd);
+	for (line = data; *line != '\0'; line = end + 1) {
+		end = strchr(line, '\n');
+		if (end == NULL)
+			end = line + strlen(line) - 1;
+		line[strcspn(line, " \t\n")] = '\0';
+		if (*line != '\0')
+			kmod_state_store(key, kmod_state_key(key, line, sizeof(key)), state);
+	}
+
+	free(data);
 	return 0;
 }
 
+/* read builtin and loaded modules, kmod_states_lock has to be held */
+
+static void kmod_state_init (init_t *init)
+{
+	struct utsname un;
+	char moddir[255];
+	char path[PATH_MAX];
+	int fd;
+
+	if (init) {
+		snprintf(moddir, sizeof(moddir), "%s", init->moddir);
+	} else if (uname(&un) == 0) {
+		snprintf(moddir, sizeof(moddir), "/lib/modules/%s", un.release);
+	} else {
+		return;
+	}
+
+	fd = open("/proc/modules", O_RDONLY);
+	if (fd < 0)
+		return;
+	if (kmod_state_read(fd, KMOD_STATE_LOADED) != 0) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	/* prefer the text list, the binary index can not be enumerated */
+	fd = open_file_read_only("%s/modules.builtin", moddir);
+	if (fd >= 0) {
+		kmod_state_read(fd, KMOD_STATE_BUILTIN);
+		close(fd);
+	} else {
+		snprintf(path, sizeof(path), "%s/modules.builtin.bin", moddir);
+		builtin_bin = bin_index_open(path);
+	}
+
+	kmod_states_ready = 1;
+}
+
+/* remember the state of a module (name or module file path), used by
+ * insmod_cmd(), rmmod_cmd() and modprobe */
+
+void
+kmodule_set_state (const char *name, int state)
+{
+	char key[NAME_MAX + 1];
+	size_t len;
+
+	len = kmod_state_key(key, name, sizeof(key));
+	if (len == 0)
+		return;
+
+	pthread_mutex_lock(&kmod_states_lock);
+	kmod_state_store(key, len, state);
+	pthread_mutex_unlock(&kmod_states_lock);
+}
+
+/* cached state of a module, KMOD_STATE_UNLOADED if nothing is known */
+
+int
+kmodule_get_state (const char *name)
+{
+	struct kmod_state *entry;
+	char key[NAME_MAX + 1];
+	size_t len;
+	int state;
+
+	len = kmod_state_key(key, name, sizeof(key));
+
+	pthread_mutex_lock(&kmod_states_lock);
+	entry = *kmod_state_slot(key, len);
+	state = entry ? entry->state : KMOD_STATE_UNLOADED;
+	pthread_mutex_unlock(&kmod_states_lock);
+
+	return state;
+}
+
+/* check if a kernel module is already loaded */
+/* return 1 = loaded, 0 = not loaded, -1 = can't tell */
+int 
+kmodule_already_loaded (init_t *init, const char *name)
+{
+	struct kmod_state *entry;
+	char key[NAME_MAX + 1];
+	size_t len;
+	int ret = 0;
+
+	len = kmod_state_key(key, name, sizeof(key));
+	if (len == 0)
+		return 0;
+
+	pthread_mutex_lock(&kmod_states_lock);
+	if (!kmod_states_ready)
+		kmod_state_init(init);
+
+	entry = *kmod_state_slot(key, len);
+	if (entry != NULL) {
+		ret = (entry->state == KMOD_STATE_LOADED ||
+		       entry->state == KMOD_STATE_BUILTIN) ? 1 : 0;
+	} else if (file_exists("/sys/module/%s", key) == 1) {
+		/* loaded by someone else, or a builtin with parameters */
+		kmod_state_store(key, len, KMOD_STATE_LOADED);
+		ret = 1;
+	} else if (builtin_bin != NULL && bin_index_search(builtin_bin, key) != NULL) {
+		kmod_state_store(key, len, KMOD_STATE_BUILTIN);
+		ret = 1;
+	} else if (!kmod_states_ready) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&kmod_states_lock);
+
+	return ret;
+}
+
 /* check if a system is HyperV */
 /* return 1 = hyperv, 0 = no hyperv, -1 = can't tell */
 int 
@@ -351,9 +526,9 @@ is_hyperv (void)
 {
 	char *buf = NULL;
 
-	buf = get_dmi_data("sys_vendor", buffer, 255);
+	buf = hwinv_dmi("sys_vendor", buffer, 255);
 	if (buf && match_string_nocase("Microsoft Corporation", buf) == 0) {
-		buf = get_dmi_data("product_name", buffer, 255);
+		buf = hwinv_dmi("product_name", buffer, 255);
 		if (buf && match_string_nocase("Virtual Machine", buf) == 0) {
 			return 1;
 		}
@@ -369,9 +544,9 @@ needs_xhci_workaround (void)
 {
 	char *buf = NULL;
 
-	buf = get_dmi_data("sys_vendor", buffer, 255);
+	buf = hwinv_dmi("sys_vendor", buffer, 255);
 	if (buf && match_string_nocase("ONYX Healthcare Inc.", buf) == 0) {
-		buf = get_dmi_data("product_name", buffer, 255);
+		buf = hwinv_dmi("product_name", buffer, 255);
 		if (buf && match_string_nocase("Venus-222", buf) == 0) {
 			return 1;
 		}
@@ -383,12 +558,21 @@ needs_xhci_workaround (void)
 void 
 load_kernel_module(init_t *init, const char *name)
 {
+	const char *origin;
+	long start;
 	int err;
 	
 	if (kmodule_already_loaded(init, name)==1) return;
+
+	/* there is no module file for it, do not ask modprobe again */
+	if (kmodule_get_state(name) == KMOD_STATE_MISSING) return;
 	
 	msg(init,LOG_INFO,"Loading %s module\n",name);
+	start = modtrace_now();
+	origin = modtrace_push("explicit");
 	err = modprobe_cmd(name);
+	modtrace_pop(origin);
+	modtrace_request(name, start, err);
 	if (err != 0)
 		msg(init,LOG_ERR,"Loading %s failed\n",name);
 }
@@ -396,16 +580,16 @@ load_kernel_module(init_t *init, const char *name)
 static void
 load_kernel_modules(init_t *init)
 {
-	int err;
 	struct stat st;
 	FILE *f;
 	char line[256];
 	uint8_t load_squashfs = 1;
 	
-	if (stat("/sbin/depmod", &st) == 0) {
-		msg(init,LOG_NOTICE," * reconfigure kernel module dependencies\n");
-		err = system("/sbin/depmod -ae");
-	}
+	depmod_update(init);
+
+	/* modules known for this hardware first, the alias scan below
+	   only picks up what is missing */
+	modplan_replay(init);
 	
 	load_alias_modules(init, "pci");
 	load_alias_modules(init, "acpi");
@@ -479,6 +663,7 @@ static int parse_cmdline(init_t *init)
 	init->firmware_partnum = 0;
 	init->osc_unattended = 0;
 	init->sys_minor = 1;
+	init->coldplug_storage = 0;
 
 	if (init->isofilename) {
 		free (init->isofilename);
@@ -587,6 +772,10 @@ static int parse_cmdline(init_t *init)
 	if (strstr (buf, "igelcmd")) {
 		init->boot_type = BOOT_WINLINUX;
 	}
+	/* a failsafe boot loads all drivers as before */
+	if (strstr (buf, "igel_coldplug=storage ") && !init->failsafe) {
+		init->coldplug_storage = 1;
+	}
 
 	return 0;
 }
@@ -691,22 +880,32 @@ get_present_igfs(int *igf_array, int *count_igf)
 /* get sizes and start positions of all (1 - MAX_PART_NUM) partitions on the igf major device */
 
 static int
-get_igfdisk_partition_data(init_t *init)
+get_igfdisk_partition_data(init_t *init, const struct disk_parts *parts)
 {
+	struct disk_parts dp;
 	char *buf;
 	int i;
-	unsigned long long sector = 512;
+	/* sysfs counts size and start in 512 byte units, whatever the
+	   logical block size of the disk is */
+	const unsigned long long sector = 512;
 	long long value;
 
-	buf = get_block_data(init->devname, "logical_block_size", buffer, 255);
-	if (buf != NULL) {
-		value = strtoll(buf, NULL, 10);
-		if ((value == LLONG_MIN || value == LLONG_MAX) && (errno == ERANGE)) {
-			sector = 512;
-		} else {
-			sector = (unsigned long long) value;
-		}
+	init->part_igel_known = 0;
+
+	/* the partition table on the disk, sysfs only if it can not be read */
+	if (parts == NULL && read_partition_table(init->devname, &dp) == 0) {
+		read_igel_signatures(init->devname, &dp);
+		parts = &dp;
+	}
+	if (parts != NULL) {
+		init->devsize = parts->devsize;
+		memcpy(init->part_start, parts->start, MAX_PART_NUM * sizeof(uint64_t));
+		memcpy(init->part_size, parts->size, MAX_PART_NUM * sizeof(uint64_t));
+		memcpy(init->part_igel, parts->igel, MAX_PART_NUM);
+		init->part_igel_known = parts->have_igel;
+		return 0;
 	}
+
 	buf = get_block_data(init->devname, "size", buffer, 255);
 	if (buf != NULL) {
 		value = strtoll(buf, NULL, 10);
@@ -759,10 +958,11 @@ get_igfdisk_partition_data(init_t *init)
 static uint64_t
 get_igf_size(const char *dev_name, int igf_num)
 {
-	unsigned long long size = 0, sector = 512;
+	unsigned long long size = 0;
 	char *buf;
 	long long value;
 
+	/* in 512 byte units like every size in sysfs */
 	buf = get_block_data_printf("size", buffer, 255, "%s%d", dev_name, igf_num);
 	if (buf != NULL) {
 		value = strtoll(buf, NULL, 10);
@@ -773,17 +973,7 @@ get_igf_size(const char *dev_name, int igf_num)
 		}
 	}
 
-	buf = get_block_data_printf("logical_block_size", buffer, 255, "%s%d", dev_name, igf_num);
-	if (buf != NULL) {
-		value = strtoll(buf, NULL, 10);
-		if ((value == LLONG_MIN || value == LLONG_MAX) && (errno == ERANGE)) {
-			sector = 512;
-		} else {
-			sector = (unsigned long long) value;
-		}
-	}
-
-	if (size > 0) return (uint64_t) (size * sector);
+	if (size > 0) return (uint64_t) (size * 512);
 	
 	return 0;
 }
@@ -1235,6 +1425,7 @@ static int
 load_igel_flash_driver(init_t *init, const char *filename)
 {
 	struct mod_opt_t opts, opts2, opts3, opts4;
+	struct kmod_struct kmod;
 	int err;
 	
 	/* insmod igel driver */
@@ -1263,8 +1454,17 @@ load_igel_flash_driver(init_t *init, const char *filename)
 		}
 	}
 	
-	snprintf(buffer,sizeof(buffer),
-		 "/%s/kernel/drivers/block/igel/igel-flash.ko", init->moddir);
+	/* the module may be compressed */
+	kmod.name = (char *) "igel-flash";
+	find_kernel_module_by_name(&kmod, init->moddir);
+	if (kmod.abs_name != NULL) {
+		snprintf(buffer, sizeof(buffer), "%s", kmod.abs_name);
+		free(kmod.realname);
+		free(kmod.abs_name);
+	} else {
+		snprintf(buffer,sizeof(buffer),
+			 "/%s/kernel/drivers/block/igel/igel-flash.ko", init->moddir);
+	}
 	
 	err = insmod_cmd(buffer, &opts);
 	
@@ -1368,14 +1568,17 @@ load_igel_migrate_flash_driver(init_t *init, const char *filename)
 
 	return (1);
 }
+/* check the partitions of the disk for the boot registry, first_part
+ * (the partition of the boot hint, 0 if none) first */
+
 static int
-check_igel_standard_device(init_t *init)
+check_igel_standard_device(init_t *init, int first_part)
 {
 	char name[PATH_SIZE], used_offset[128];
 	int err;
-	char *boot_id1, *boot_id2, *p;
-	int part = 1, found = 0;
-    	bootreg_data* hndl = NULL;
+	const char *boot_id1, *boot_id2, *p;
+	int i, part = 1, found = 0;
+	struct bootsnap *snap;
 
 	snprintf(name, sizeof(name), "/sys/block/%s/dev", init->devname);
 	name[sizeof(name)-1] = '\0';
@@ -1386,8 +1589,12 @@ check_igel_standard_device(init_t *init)
 	init->use_backports = 0;
 	init->igel_poffset = 0;
 
-	/* check 1st and following partitions up to MAX_PART_NUM */
-	for (part=1; part<= MAX_PART_NUM && found == 0; part++) {
+	/* check the partition of the hint, then the 1st and following
+	   partitions up to MAX_PART_NUM */
+	for (i = 0; i <= MAX_PART_NUM && found == 0; i++) {
+		part = (i == 0) ? first_part : i;
+		if (part <= 0 || (i > 0 && part == first_part))
+			continue;
 
 		snprintf(name, sizeof(name), "/sys/block/%s/%s%s%d/dev", 
 			 init->devname, init->devname, init->part_prefix, part);
@@ -1397,19 +1604,20 @@ check_igel_standard_device(init_t *init)
 		/* if there is no sys entry there also is no partition so try next */
 		if (access(name, R_OK) != 0)
 			continue;
+
+		/* without bootreg ident and PDIR magic there is no boot registry */
+		if (init->part_igel_known && !init->part_igel[part - 1])
+			continue;
 		
 		if (! create_igel_device(init, name, IGF_DISK_NAME)) {
 			unlink(IGF_BOOT_NAME);
 			return 0;
 		}
 
-		if (hndl) {
-	        	bootreg_deinit(&hndl);
-			hndl = NULL;
-		}
-		
-		hndl = bootreg_init(IGF_DISK_NAME, BOOTREG_RDONLY, BOOTREG_LOG_NONE);
-		if(!hndl)
+		/* one read of the boot registry per partition */
+		bootsnap_free(init->bootsnap);
+		init->bootsnap = bootsnap_load(IGF_DISK_NAME);
+		if (init->bootsnap == NULL)
 		{
 			continue;
 		}
@@ -1426,7 +1634,7 @@ check_igel_standard_device(init_t *init)
 		{ 
 			msg(init, LOG_INFO, "init: boot id from cmdline: %s\n",
 			    boot_id1);
-			bootreg_get(hndl, "boot_id", &boot_id2);
+			boot_id2 = bootsnap_get(init->bootsnap, "boot_id");
 			msg(init, LOG_INFO, "init: boot id from %s: %s\n",
 			    IGF_DISK_NAME, (boot_id2) ? boot_id2 : "NULL");
 
@@ -1434,22 +1642,17 @@ check_igel_standard_device(init_t *init)
 				continue;	/* don't accept */
 			}
 			if (strcmp(boot_id1, boot_id2) != 0) {
-				free(boot_id2);
 				continue;	/* no match: don't accept */
 			}
-			free(boot_id2);
-			boot_id2 = NULL;
 			found = part;
 			break;
 		}
 		else /* no boot_id from kernel cmdline */
 		{
 			msg(init, LOG_INFO, "init: boot id from cmdline: NULL\n");
-			bootreg_get(hndl, "boot_id", &p);
+			p = bootsnap_get(init->bootsnap, "boot_id");
 			if (p != NULL)
 			{
-				free(p);
-				p = NULL;
 				msg(init, LOG_INFO, "init: boot id from %s: not NULL\n",
 				    IGF_DISK_NAME);
 				continue;	/* don't accept */
@@ -1462,7 +1665,7 @@ check_igel_standard_device(init_t *init)
 	/* get backports usage setting from bootreg if present */
 
 	if (found != 0) {
-		bootreg_get(hndl, "use_backports", &p);
+		p = bootsnap_get(init->bootsnap, "use_backports");
 		if (p != NULL) {
 			if (strcmp(p, "true") == 0) {
 				init->use_backports = 1;
@@ -1470,7 +1673,7 @@ check_igel_standard_device(init_t *init)
 				init->use_backports = -1;
 			}
 		}
-		bootreg_get(hndl, "igel_poffset", &p);
+		p = bootsnap_get(init->bootsnap, "igel_poffset");
 		if (p != NULL) {
 			unsigned long long value = 0;
 			value = strtoull(p, NULL, 10);
@@ -1480,17 +1683,17 @@ check_igel_standard_device(init_t *init)
 			init->igel_poffset = value;
 		}
 	}
-        /*cleanup handler*/
-	if (hndl)
-	        bootreg_deinit(&hndl);
+	if (found == 0) {
+		bootsnap_free(init->bootsnap);
+		init->bootsnap = NULL;
+	}
 
 	if (found > 0 && init->igel_poffset > 0) {
-		hndl = bootreg_init(IGF_DISK_NAME, BOOTREG_RDWR, BOOTREG_LOG_NONE);
-		if (hndl) {
-			/* only one try so delete the bootreg entry here */
-			bootreg_set(hndl, "igel_poffset", "0");
-	        	bootreg_deinit(&hndl);
-		}
+		/* only one try so delete the bootreg entry here, the
+		   offset must not be tried again if booting from it fails */
+		bootsnap_set(init->bootsnap, "igel_poffset", "0");
+		if (bootsnap_commit(init->bootsnap) != 0)
+			msg(init, LOG_ERR, "init: can not reset igel poffset\n");
 
 		if (check_if_igel_part(init->igel_poffset) == 0) {
 			msg(init, LOG_INFO, "init: igel poffset %llu seems to be valid\n", (unsigned long long)init->igel_poffset);
@@ -1513,11 +1716,11 @@ check_igel_standard_device(init_t *init)
 		}
 		err = create_loop_device(IGF_BOOT_NAME, loopdev, init->igel_poffset, (uint64_t) newsize);
 		if (err == 0) {
-			hndl = bootreg_init(loopdev, BOOTREG_RDONLY, BOOTREG_LOG_NONE);
-			if(hndl)
+			snap = bootsnap_load(loopdev);
+			if(snap)
 			{
 				boot_id1 = init->boot_id;
-				bootreg_get(hndl, "boot_id", &boot_id2);
+				boot_id2 = bootsnap_get(snap, "boot_id");
 				if (boot_id2 == NULL) {
 					msg(init, LOG_INFO, "init: No boot_id found on given igel offset\n");
 					init->igel_poffset = 0;
@@ -1525,7 +1728,6 @@ check_igel_standard_device(init_t *init)
 					msg(init, LOG_INFO, "init: Wrong boot_id (found: %s expected: %s) found on given igel offset\n", boot_id2, boot_id1);
 					init->igel_poffset = 0;
 				}
-	        		bootreg_deinit(&hndl);
 			} else {
 				init->igel_poffset = 0;
 			}
@@ -1535,6 +1737,9 @@ check_igel_standard_device(init_t *init)
 					int len_to_w = 0;
 					unlink(IGF_DISK_NAME);
 					err = symlink(loopdev, IGF_DISK_NAME);
+					/* the boot registry at the offset is used from now on */
+					bootsnap_free(init->bootsnap);
+					init->bootsnap = snap;
 					msg(init, LOG_INFO, "init: Flash driver load with igel offset loop dev was successful\n");
 					len_to_w = snprintf(used_offset, 128, "%llu", (unsigned long long) init->igel_poffset);
 					fd = open("/dev/igel_used_offset", O_WRONLY|O_CREAT, 0644);
@@ -1551,6 +1756,7 @@ check_igel_standard_device(init_t *init)
 					start_rescue_shell(init);
 
 			}
+			bootsnap_free(snap);
 			loop_device_unset(loopdev);
 		} else {
 			msg(init, LOG_INFO, "init: Could not create loopdev with offset for migration with err: %d\n", err);
@@ -1592,22 +1798,16 @@ check_igel_osc_token(init_t *init)
 	char *osc_path = NULL;
 	int part_del_num = 0;
 	int parts_to_del[10];
-	struct vendor_list *vendors;
 
 	if (init->osc_unattended) {
 		parts_to_del[part_del_num] = 29;
 		part_del_num++;
 	}
 
-	vendors = malloc(sizeof (struct vendor_list));
-	if (vendors) {
-		memset(vendors, 0, sizeof (struct vendor_list));
-		strncpy(vendors->name, "0x10DE", 7);
-
-		if (find_pci_vendors(vendors) == 0) {
-			parts_to_del[part_del_num] = 60;
-			part_del_num++;
-		}
+	/* no NVIDIA graphics */
+	if (!hwinv_has_pci_vendor(0x10de)) {
+		parts_to_del[part_del_num] = 60;
+		part_del_num++;
 	}
 
 	memset(iso_loop_device, 0, sizeof(iso_loop_device));
@@ -2140,7 +2340,6 @@ check_igel_udc_pxe(init_t *init)
 	long ddimage_size;
 	int part_del_num = 0;
 	int parts_to_del[10];
-	struct vendor_list *vendors;
 	char option[128];
 
 	if (init->osc_unattended) {
@@ -2148,16 +2347,10 @@ check_igel_udc_pxe(init_t *init)
 		part_del_num++;
 	}
 
-	vendors = malloc(sizeof (struct vendor_list));
-	if (vendors) {
-		memset(vendors, 0, sizeof (struct vendor_list));
-		strncpy(vendors->name, "0x10DE", 7);
-
-		if (find_pci_vendors(vendors) == 0) {
-			parts_to_del[part_del_num] = 60;
-			part_del_num++;
-		}
-		free(vendors);
+	/* no NVIDIA graphics */
+	if (!hwinv_has_pci_vendor(0x10de)) {
+		parts_to_del[part_del_num] = 60;
+		part_del_num++;
 	}
 		
 	/* check ddimage file */
@@ -2262,14 +2455,9 @@ check_igel_winlinux(init_t *init){
 	return (load_igel_flash_driver(init, INITRD_IMG));
 }
 
-static int
-find_igel_device(init_t *init)
+static void
+reset_igel_device(init_t *init)
 {
-	DIR *dir;
-	struct dirent *dent;
-	char *str = NULL;
-        bootreg_data* hndl = NULL;
-
 	if (init->devname) {
 		free(init->devname);
 		init->devname = NULL;
@@ -2278,112 +2466,169 @@ find_igel_device(init_t *init)
 		free(init->part_prefix);
 		init->part_prefix = NULL;
 	}
+	init->devsize = 0;
+	memset(init->part_start, 0, MAX_PART_NUM * sizeof(uint64_t));
+	memset(init->part_size, 0, MAX_PART_NUM * sizeof(uint64_t));
+	init->part_igel_known = 0;
+	bootsnap_free(init->bootsnap);
+	init->bootsnap = NULL;
+}
 
-	dir = opendir("/sys/block");
-	if (dir != NULL) {
-		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
-			init->major_update = 0;
-			init->major_update_keep_jre = 0;
-			init->major_update_keep_nvidia = 0;
-			if (dent->d_name[0] == '.')
-				continue;
-			if(NULL != strstr(dent->d_name,"ram"))
-				continue;
-			if(NULL != strstr(dent->d_name,"loop"))
-				continue;
-			init->devname = strdup(dent->d_name);
-			if(strncmp(init->devname,"mmcblk",6)== 0){
-				init->part_prefix = strdup("p");
-			} else if(strncmp(init->devname,"nvme",4)== 0){
-				init->part_prefix = strdup("p");
-			} else {
-				init->part_prefix = strdup("");
-			}
-			if (get_igfdisk_partition_data(init) != 0) {
-				init->devsize = 0;
-				memset(init->part_start, 0, MAX_PART_NUM * sizeof(uint64_t));
-				memset(init->part_size, 0, MAX_PART_NUM * sizeof(uint64_t));
-			}
-			switch (init->boot_type) {
-			  case BOOT_STANDARD:
-			  	if (check_igel_standard_device(init)) {
-					init->found = 1;
-					hndl = bootreg_init(IGF_DISK_NAME, BOOTREG_RDWR, BOOTREG_LOG_NONE);
-					if (hndl != NULL)
-					{
-						bootreg_get(hndl, "major_update", &str);
-					}
-					if (hndl != NULL && str != NULL && str[0] == '1')
-					{
-						free(str);
-						str = NULL;
-                                                /* do reset major update flag if no_major_update is set (from parse_cmdline
-                                                 * if failsafe boot, emergency boot or resetdefaults was set) */
-						if (init->no_major_update != 0)
-						{
-							msg(init, LOG_ERR, "major update: disabled due to choosen boot mode");
-							bootreg_set(hndl, "major_update", "0");
-							init->major_update = 0;
-						}
-						else
-						{
-							init->major_update = 1;
-						}
-					}
-					if (hndl != NULL && init->major_update == 1)
-					{
-						bootreg_get(hndl, "major_update_keep_jre", &str);
-						if (hndl != NULL && str != NULL && str[0] == '1')
-						{
-							free(str);
-							str = NULL;
-							init->major_update_keep_jre = 1;
-						} else {
-							init->major_update_keep_jre = 0;
-						}
-						bootreg_get(hndl, "major_update_keep_nvidia", &str);
-						if (hndl != NULL && str != NULL && str[0] == '1')
-						{
-							free(str);
-							str = NULL;
-							init->major_update_keep_nvidia = 1;
-						} else {
-							init->major_update_keep_nvidia = 0;
-						}
-					}
-					if (hndl != NULL)
-					{
-						bootreg_deinit(&hndl);
-					}
-				}
-				break;
-			  case BOOT_OSC_TOKEN:
-			  	if (check_igel_osc_token(init)) {
-					init->found = 1;
-				}
-				break;
-			  case BOOT_OSC_PXE:
-				if (check_igel_udc_pxe(init)) {
-					init->found = 1;
+/* disks which can not hold the igel boot device */
+
+static int
+igel_disk_candidate(const char *name)
+{
+	if (name[0] == '.')
+		return (0);
+	if(NULL != strstr(name,"ram"))
+		return (0);
+	if(NULL != strstr(name,"loop"))
+		return (0);
+	return (1);
+}
+
+/* check if the disk name (entry of /sys/block) is the igel boot device,
+ * parts is its partition table if it was read already */
+
+static int
+check_igel_disk(init_t *init, const char *name, const struct disk_parts *parts,
+		int first_part)
+{
+	const char *str;
+
+	init->major_update = 0;
+	init->major_update_keep_jre = 0;
+	init->major_update_keep_nvidia = 0;
+	if (!igel_disk_candidate(name))
+		return (0);
+
+	reset_igel_device(init);
+	init->devname = strdup(name);
+	if(strncmp(init->devname,"mmcblk",6)== 0){
+		init->part_prefix = strdup("p");
+	} else if(strncmp(init->devname,"nvme",4)== 0){
+		init->part_prefix = strdup("p");
+	} else {
+		init->part_prefix = strdup("");
+	}
+	if (get_igfdisk_partition_data(init, parts) != 0) {
+		init->devsize = 0;
+		memset(init->part_start, 0, MAX_PART_NUM * sizeof(uint64_t));
+		memset(init->part_size, 0, MAX_PART_NUM * sizeof(uint64_t));
+	}
+	switch (init->boot_type) {
+	  case BOOT_STANDARD:
+	  	if (check_igel_standard_device(init, first_part)) {
+			init->found = 1;
+			/* the flags come from the snapshot the device check
+			   read, changes are written by bootsnap_commit() */
+			str = bootsnap_get(init->bootsnap, "major_update");
+			if (str != NULL && str[0] == '1')
+			{
+				/* do reset major update flag if no_major_update is set (from parse_cmdline
+				 * if failsafe boot, emergency boot or resetdefaults was set) */
+				if (init->no_major_update != 0)
+				{
+					msg(init, LOG_ERR, "major update: disabled due to choosen boot mode");
+					bootsnap_set(init->bootsnap, "major_update", "0");
+					init->major_update = 0;
 				}
-				break;
-			  case BOOT_WINLINUX:
-				if (check_igel_winlinux(init)) {
-					init->found = 1;
+				else
+				{
+					init->major_update = 1;
 				}
-				break;
 			}
-			if (init->found == 1) {
+			if (init->major_update == 1)
+			{
+				str = bootsnap_get(init->bootsnap, "major_update_keep_jre");
+				init->major_update_keep_jre = (str != NULL && str[0] == '1');
+				str = bootsnap_get(init->bootsnap, "major_update_keep_nvidia");
+				init->major_update_keep_nvidia = (str != NULL && str[0] == '1');
+			}
+		}
+		break;
+	  case BOOT_OSC_TOKEN:
+	  	if (check_igel_osc_token(init)) {
+			init->found = 1;
+		}
+		break;
+	  case BOOT_OSC_PXE:
+		if (check_igel_udc_pxe(init)) {
+			init->found = 1;
+		}
+		break;
+	  case BOOT_WINLINUX:
+		if (check_igel_winlinux(init)) {
+			init->found = 1;
+		}
+		break;
+	}
+	if (init->found == 1)
+		return (1);
+
+	reset_igel_device(init);
+	return (0);
+}
+
+/* one round over the disks, probe is the set of disk probes of the whole
+   search or NULL. *unprobed is set to the number of disks which were
+   checked before their probe finished */
+
+static int
+find_igel_device(init_t *init, struct disk_probe_set *probe, int *unprobed)
+{
+	struct disk_parts parts;
+	char hint[64];
+	const char *name;
+	DIR *dir;
+	struct dirent *dent;
+	int i, have_parts, part;
+
+	reset_igel_device(init);
+	*unprobed = 0;
+
+	/* the module plan of disks which need a storage driver module */
+	modplan_load(init);
+
+	/* the boot device of the last boot first, one try only. The hint
+	   is looked for on the disks which showed up after coldplug too */
+	if (init->boot_type == BOOT_STANDARD)
+		boothint_load(init);
+	if (init->boot_type == BOOT_STANDARD &&
+	    (name = boothint_disk(init, hint, sizeof(hint), &part)) != NULL) {
+		if (check_igel_disk(init, name, NULL, part))
+			return (1);
+		msg(init,LOG_INFO,"boothint: %s is not the boot device anymore\n", name);
+		boothint_drop(init);
+	}
+
+	/* the disks are read in parallel but checked one after the other,
+	   internal disks before USB unless booting from a token */
+	if (probe != NULL &&
+	    diskprobe_start(probe, igel_disk_candidate,
+			    init->boot_type == BOOT_OSC_TOKEN ? NULL : boothint_rank) > 0) {
+		for (i = 0; i < diskprobe_count(probe); i++) {
+			/* a disk whose probe did not finish is read here,
+			   the order stays the same */
+			name = diskprobe_wait(probe, i, &parts, &have_parts);
+			if (name == NULL) {
+				name = diskprobe_name(probe, i);
+				(*unprobed)++;
+			}
+			if (check_igel_disk(init, name, have_parts ? &parts : NULL, 0))
+				return (1);
+		}
+		return (0);
+	}
+
+	dir = opendir("/sys/block");
+	if (dir != NULL) {
+		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
+			if (check_igel_disk(init, dent->d_name, NULL, 0)) {
 				closedir(dir);
 				return (1);
 			}
-			free(init->devname);
-			init->devname = NULL;
-			free(init->part_prefix);
-			init->part_prefix = NULL;
-			init->devsize = 0;
-			memset(init->part_start, 0, MAX_PART_NUM * sizeof(uint64_t));
-			memset(init->part_size, 0, MAX_PART_NUM * sizeof(uint64_t));
 		}
 		closedir(dir);
 	}
@@ -2391,45 +2636,116 @@ find_igel_device(init_t *init)
 	return (0);
 }
 
+/* Waiting for the boot device is bounded by FIND_DEVICE_TIMEOUT. With
+ * uevents the waiter sleeps until block devices are added or changed and
+ * only checks the disks they belong to, so the boot device is taken as
+ * soon as its partitions show up. Drivers which are not requested by any
+ * modalias are loaded by the escalation steps once enough time passed
+ * without a boot device, and retried every ESCALATE_PERIOD. */
+
+#define FIND_DEVICE_TIMEOUT	30000	/* in msec */
+#define ESCALATE_PERIOD		3000	/* in msec */
+
+static const struct {
+	long		after;		/* msec without boot device */
+	const char	*module;
+} find_escalation[] = {
+	{ 3000, "usb-storage" },
+	{ 3000, "nvme" },
+	{ 6000, "mmc_block" },
+};
+
+#define N_ESCALATION	(sizeof(find_escalation) / sizeof(find_escalation[0]))
+
 static void
 find_igel_device_loop(init_t *init)
 {
+	struct disk_probe_set *probe;
+	struct uevent_disks disks;
+	long start, elapsed, wait, next_usb, next_all;
+	long next_step[N_ESCALATION];
+	unsigned int i;
+	int n, unprobed;
+
+	start = modtrace_now() / 1000;
+	next_usb = 1000;
+	next_all = 2750;
+	for (i = 0; i < N_ESCALATION; i++)
+		next_step[i] = find_escalation[i].after;
+
+	/* the disk probes are kept over the rounds, a disk which hangs is
+	   not read again by every round */
+	probe = diskprobe_open();
+	if (find_igel_device(init, probe, &unprobed))
+		goto out;
+
 	while (1) {
-		if (find_igel_device(init))
+		elapsed = modtrace_now() / 1000 - start;
+		if (elapsed >= FIND_DEVICE_TIMEOUT)
 			break;
-			
-		usleep(WAIT_TIME);
+
+		/* sleep until the next escalation step is due, at most a
+		   second to keep an eye on the eMMC drivers */
+		wait = FIND_DEVICE_TIMEOUT - elapsed;
+		for (i = 0; i < N_ESCALATION; i++) {
+			if (next_step[i] - elapsed < wait)
+				wait = next_step[i] - elapsed;
+		}
+		if (wait > 1000)
+			wait = 1000;
+		if (wait < 0)
+			wait = 0;
+
+		/* with uevents the drivers for new hardware are loaded while
+		   waiting, only the disks which changed are checked. All disks
+		   are checked again as long as a disk was checked before its
+		   probe finished, no uevent tells when it answers */
+		if (uevent_active()) {
+			n = uevent_wait(init, wait, &disks);
+			if ((n > 0 && disks.all) || unprobed > 0) {
+				if (find_igel_device(init, probe, &unprobed))
+					break;
+			} else if (n > 0) {
+				for (n = 0; n < disks.count; n++) {
+					if (check_igel_disk(init, disks.name[n], NULL, 0))
+						goto out;
+				}
+			}
+		} else {
+			usleep(WAIT_TIME);
+			if (find_igel_device(init, probe, &unprobed))
+				break;
+		}
 		init->try++;
+		elapsed = modtrace_now() / 1000 - start;
 	
 		/* check for newly plugged usb devices via module alias */
-		if ((init->try % 4) == 0) {
+		if (!uevent_active() && elapsed >= next_usb) {
+			next_usb = elapsed + 1000;
 			if (load_alias_modules(init, "usb") == 0)
 				msg(init,LOG_NOTICE,
 				  " * looking for usb devices (via alias)\n");
 		}
 		/* check for all available devices via module alias */
-		if ((init->try % 11) == 0) {
+		if (!uevent_active() && elapsed >= next_all) {
+			next_all = elapsed + 2750;
 			if (load_alias_modules(init, "all") == 0)
 				msg(init,LOG_NOTICE,
 				  " * looking for devices (via module alias)\n");
 		}
-		/* load usb-storage anyways */
-		if ((init->try % 12) == 0) {
-			/* ensure usb-storage will be loaded */
-			if (kmodule_already_loaded(init, "usb-storage") != 1 ){
-				msg(init,LOG_NOTICE,
-				  " * loading usb-storage anyways\n");
-				load_kernel_module(init,"usb-storage");
-			}
-			/* ensure nvme will be loaded */
-			if (kmodule_already_loaded(init, "nvme") != 1 ){
+
+		/* load the storage drivers anyways */
+		for (i = 0; i < N_ESCALATION; i++) {
+			if (elapsed < next_step[i])
+				continue;
+			next_step[i] = elapsed + ESCALATE_PERIOD;
+			if (kmodule_already_loaded(init, find_escalation[i].module) != 1) {
 				msg(init,LOG_NOTICE,
-				  " * loading nvme anyways\n");
-				load_kernel_module(init,"nvme");
+				  " * loading %s anyways\n", find_escalation[i].module);
+				load_kernel_module(init, find_escalation[i].module);
 			}
 		}
 
-
 		/* ensure eMMC drivers load also mmc_core and mmc_block */
 
 		if (kmodule_already_loaded(init, "sdhci") == 1 ||
@@ -2441,136 +2757,12 @@ find_igel_device_loop(init_t *init)
 		    if (kmodule_already_loaded(init, "mmc_block") != 1)
 			load_kernel_module(init,"mmc_block");
 		}
-	
-		/* timeout: */
-		/* try==4 -> 1 sec, try==120 -> 30 sec */
-		if ((init->try % 120) == 0) {
-			break;
-		}
 	}
-}
 
-static int
-create_sysfs_device(init_t *init, mode_t type, const char *sysfs_path, char *devname,
-		    char *devdir, uid_t owner, gid_t group)
-{
-	char path[PATH_SIZE], *buf;
-	int err;
-	struct mmdev dev;
-	struct stat st;
-	
-	buf = get_sysfs_entry(buffer, 255, "/%s/%s/dev", sysfs_path, devname);
-	if (buf == NULL)
-		return 0;
-	
-	if (devdir)
-		snprintf(path, sizeof(path), "/dev/%s/%s", devdir, devname);
-	else
-		snprintf(path, sizeof(path), "/dev/%s", devname);
-	path[sizeof(path)-1] = '\0';
-	
-	/* if the device node exists, do not change it */
-	if (stat(path, &st) == 0) return 1;
-	
-	if (sscanf(buf,"%d:%d",&dev.major,&dev.minor)!=2)
-		return 0;
-	if (mknod(path, type | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP, 
-	    makedev(dev.major, dev.minor)) != 0)
-		return 0;
-	
-	err = chown(path,owner,group);
-	
-	return 1;
-}
-
-/* create recursivly block devices:
-   look for devices /sys/block/ and its subdirectories */
-static void
-create_block_devices(init_t *init, const char *base, int depth)
-{
-	DIR *dir;
-	struct dirent *dent;
-	char path[PATH_SIZE];
-	struct stat st;
-	
-	if (depth > 2) return;
-	
-	dir = opendir(base);
-	if (dir != NULL) {
-		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
-			if (dent->d_name[0] == '.')
-				continue;
-			
-			snprintf(path, sizeof(path), "/%s/%s", base, dent->d_name);
-			path[sizeof(path)-1] = '\0';
-			
-			if ((stat(path, &st)==0) && S_ISDIR(st.st_mode)) {
-				
-				create_sysfs_device(init, 
-						S_IFBLK, base, dent->d_name,
-						NULL, /* no devdir */
-						0,6);/*uid=root,gid=disk*/
-			
-				if ((depth == 1) && 
-				    (strncmp(dent->d_name,"igf",3) != 0)) {
-					depth++;
-					create_block_devices(init, path, depth);
-				}
-			}
-		}
-		closedir(dir);
-	}
-}
-
-/* create tty devices:
-   look for devices /sys/devices/virtual/tty without subdirectories */
-static void
-create_tty_devices(init_t *init, const char *base)
-{
-	DIR *dir;
-	struct dirent *dent;
-	
-	dir = opendir(base);
-	if (dir != NULL) {
-		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
-			if (dent->d_name[0] == '.')
-				continue;
-			
-			create_sysfs_device(init, S_IFCHR, base, dent->d_name,
-					    NULL, /* no devdir */
-					    0,100);/*uid=root,gid=users*/
-		}
-		closedir(dir);
-	}
-}
-
-/* create virtual devices:
-   look for devices /sys/devices/virtual/... without subdirectories */
-static void
-create_virtual_devices(init_t *init, const char *base)
-{
-	DIR *dir;
-	struct dirent *dent;
-	char *devdir = NULL;
-	
-	if (strstr(base,"/input")) {
-		devdir = (char *) "input";
-		mkdir("/dev/input", 0755);
-	}
-	
-	dir = opendir(base);
-	if (dir != NULL) {
-		for (dent = readdir(dir); dent != NULL; dent = readdir(dir)) {
-			if (dent->d_name[0] == '.')
-				continue;
-			
-			
-			create_sysfs_device(init, S_IFCHR, base, dent->d_name,
-					    devdir,
-					    0,0);/*uid=root,gid=root*/
-		}
-		closedir(dir);
-	}
+out:
+	n = diskprobe_close(probe);
+	if (n > 0)
+		msg(init,LOG_INFO,"diskprobe: %d disks still not answering\n", n);
 }
 
 #ifndef RAMFS_MAGIC
@@ -2888,7 +3080,6 @@ boot_igel_for_major_update(init_t *init)
 	FILE *f;
         char ro_mnt[512], rw_mnt[512], root_ro[512], root_rw[512];
 	char string[1582], loop_device[30];
-	bootreg_data* hndl;
 	int loop_minor = 0;
 	/*
 	 *   1: igf1   -> system partition
@@ -2902,6 +3093,9 @@ boot_igel_for_major_update(init_t *init)
 	int to_copy[7] = {1, 23, 25, 254, 255}, copy_count = 5;
 	struct kmod_struct kmod;
 	char *migrate_kmod = (char *)"igel-flash.ko";
+	unsigned char *img;
+	size_t img_size;
+	long img_len;
 	struct stat st;
 
 	to_copy[0] = init->sys_minor;
@@ -2925,12 +3119,8 @@ boot_igel_for_major_update(init_t *init)
 	sprintf(root_ro, "/root%s/ro/sys", IGF_MNT_SYSTEM);
 	sprintf(root_rw, "/root%s/rw", IGF_MNT_SYSTEM);
 
-	/* reset major update bootreg value */
-	hndl = bootreg_init(IGF_DISK_NAME, BOOTREG_RDWR, BOOTREG_LOG_NONE);
-	if (hndl != NULL) {
-		bootreg_set(hndl, "major_update", "0");
-		bootreg_deinit(&hndl);
-	}
+	/* the major update bootreg value was reset by bootsnap_commit()
+	   in main() */
 
 	if (igf_to_ddimage(init, copy_count, to_copy) != 0) {
 		msg(init,LOG_ERR,"init: Creating /dev/ddimage.dd for major update failed\n");
@@ -3062,7 +3252,26 @@ boot_igel_for_major_update(init_t *init)
 	find_kernel_module_by_name(&kmod, init->moddir);
 	if (kmod.realname != NULL) {
 		mkdir("/root/igel-migrate-flash", 0755);
-		copy_file(kmod.abs_name, "/root/igel-migrate-flash/igel-flash.ko");
+		if (module_ext_len(kmod.abs_name, strlen(kmod.abs_name)) == 3) {
+			copy_file(kmod.abs_name, "/root/igel-migrate-flash/igel-flash.ko");
+		} else {
+			/* the migration loads igel-flash.ko, a compressed
+			   module is decompressed while copying */
+			img = NULL;
+			img_size = 0;
+			img_len = read_module_image(kmod.abs_name, &img, &img_size);
+			if (img_len < 0) {
+				msg(init,LOG_ERR,"init: can not decompress %s\n", kmod.abs_name);
+			} else {
+				fd = open("/root/igel-migrate-flash/igel-flash.ko",
+					  O_WRONLY|O_CREAT|O_TRUNC|O_SYNC, 0644);
+				if (fd < 0 || iwrite(fd, img, img_len) != img_len)
+					msg(init,LOG_ERR,"init: can not write igel-flash.ko\n");
+				if (fd >= 0)
+					close(fd);
+			}
+			free(img);
+		}
 		free(kmod.realname);
 		free(kmod.abs_name);
 	}
@@ -3573,10 +3782,16 @@ int main(int argc, char **argv)
 	msg(&init,LOG_NOTICE,"\n(c)2019, IGEL Technology GmbH\n\n");
 	msg(&init,LOG_NOTICE," * booting, kernel '%s' ...\n",kernel_signature);
 
+	/* DMI and PCI ids for all hardware checks below */
+	hwinv_collect();
+
 	if (needs_xhci_workaround() == 1) {
 		xhci_workaround();
 	}
 
+	/* listen for hardware showing up while and after the drivers load */
+	uevent_open(&init);
+
 	load_kernel_modules(&init);
 
 	/* eMMC drivers */	
@@ -3626,13 +3841,29 @@ int main(int argc, char **argv)
 		find_igel_device_loop(&init);
   
   		if (init.found) {
-			create_block_devices(&init, "/sys/block", 1);
-			create_tty_devices(&init, "/sys/devices/virtual/tty");
-			create_virtual_devices(&init, "/sys/devices/virtual/mem");
-			create_virtual_devices(&init, "/sys/devices/virtual/misc");
-			create_virtual_devices(&init, "/sys/devices/virtual/input");
-			create_virtual_devices(&init, "/sys/devices/virtual/vc");
-			/* TODO: do we need to fix permisions in /dev ? */
+			/* remember the modules needed to get here and
+			   where the boot device was */
+			if (init.boot_type == BOOT_STANDARD) {
+				modplan_save(&init);
+				if (init.igel_poffset == 0)
+					boothint_save(&init);
+				/* the major update is done only once */
+				if (init.major_update)
+					bootsnap_set(init.bootsnap, "major_update", "0");
+				/* write all changes of the boot registry at once */
+				if (bootsnap_commit(init.bootsnap) != 0)
+					msg(&init,LOG_ERR,"init: can not write the boot registry\n");
+			}
+			modtrace_summary(&init);
+			if (hwinv_export() != 0)
+				msg(&init,LOG_ERR,"init: can not write the hardware inventory\n");
+
+			/* module resolution data is not needed anymore,
+			   give the memory back before the image copies */
+			modprobe_release(&init);
+			alias_release(&init);
+
+			reconcile_devices(&init);
 			
 			if (init.verbose) {
 				print_init(&init);
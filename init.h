@@ -51,6 +51,7 @@ struct kmod_struct {
 struct mod_list {
 	char 		*alias;
 	struct mod_list	*next;
+	int		pending;	/* a module of the alias is not loaded */
 };
 
 typedef struct devlist_s devlist_t;
@@ -81,16 +82,21 @@ struct init_s {
 	uint64_t      devsize;
 	uint64_t      part_start[MAX_PART_NUM];
 	uint64_t      part_size[MAX_PART_NUM];
+	unsigned char part_igel[MAX_PART_NUM];	/* has the IGEL signatures */
+	int           part_igel_known;
 	struct mmdev  dev;
 	char	      moddir[255];
 	/* from kernel cmdline: */
 	int           verbose;
 	int	      bootversion;
 	char	      *boot_id;
+	char	      *boot_hint;	/* boot device of the last boot */
+	struct bootsnap *bootsnap;	/* boot registry of the boot partition */
 	char 	      *initcmd;
 	int	      runlevel;
 	int	      splash;
 	int	      failsafe;
+	int	      coldplug_storage;	/* only load drivers needed for booting */
 	/* misc */
 	const char    *current_console;
 	unsigned      boot_type;
@@ -116,6 +122,13 @@ struct vendor_list {
 	struct vendor_list *next;
 };
 
+/* cached module states, see kmodule_get_state() */
+#define KMOD_STATE_UNLOADED	0
+#define KMOD_STATE_LOADED	1
+#define KMOD_STATE_BUILTIN	2
+#define KMOD_STATE_FAILED	-1	/* insmod failed */
+#define KMOD_STATE_MISSING	-2	/* no module file */
+
 /* one-way list of options to pass to a insmod kernel module command */
 struct mod_opt_t {
 	char *  m_opt_val;
@@ -124,6 +137,8 @@ struct mod_opt_t {
 
 /* alias.c */
 extern int load_alias_modules(init_t *init, const char *device);
+extern int load_modalias_modules(init_t *init, char **modaliases, int count);
+extern void alias_release(init_t *init);
 
 /* console.c */
 extern int setlogcons(init_t *init, int console);
@@ -135,9 +150,13 @@ extern void msg(init_t *init, int level, const char *fmt, ...) __attribute__ ((f
 
 /* insmod.c */
 extern int insmod_cmd(char *filename, struct mod_opt_t *opts);
+extern long read_module_image(const char *filename, unsigned char **buf, size_t *size);
 /* modprobe.c */
 extern int modprobe_cmd(const char *name);
 extern int modprobe(int argc, char **argv);
+extern int modprobe_batch(init_t *init, const char **names, int count);
+extern int modprobe_blacklisted(const char *name);
+extern void modprobe_release(init_t *init);
 /* rmmod.c */
 extern int rmmod_cmd(const char *name);
 
@@ -159,6 +178,8 @@ char *read_file (int len, char *buffer, int buf_len, const char* format, ...) __
 /* init.c */
 void start_rescue_shell(init_t *init);
 int kmodule_already_loaded (init_t *init, const char *name);
+int kmodule_get_state (const char *name);
+void kmodule_set_state (const char *name, int state);
 int is_hyperv (void);
 int needs_xhci_workaround (void);
 void load_kernel_module(init_t *init, const char *name);
@@ -172,6 +193,119 @@ uint32_t updcrc(unsigned char* s, unsigned n);
 /* alias.c */
 void find_kernel_module_by_name (struct kmod_struct *list, const char *path);
 
+/* uevent.c */
+#define UEVENT_MAX_DISKS	16
+
+/* disks with block devices added or changed */
+struct uevent_disks {
+	char	name[UEVENT_MAX_DISKS][32];
+	int	count;
+	int	all;		/* events were lost, check all disks */
+};
+
+int uevent_open (init_t *init);
+void uevent_close (void);
+int uevent_active (void);
+int uevent_wait (init_t *init, int timeout_ms, struct uevent_disks *disks);
+
+/* depmod.c */
+int depmod_update (init_t *init);
+
+/* parttable.c */
+struct disk_parts {
+	uint64_t	devsize;		/* in bytes */
+	uint64_t	start[MAX_PART_NUM];
+	uint64_t	size[MAX_PART_NUM];
+	unsigned char	igel[MAX_PART_NUM];	/* bootreg ident and PDIR found */
+	int		have_igel;		/* igel[] is valid */
+};
+int read_partition_table (const char *devname, struct disk_parts *dp);
+void read_igel_signatures (const char *devname, struct disk_parts *dp);
+int igel_partition (const char *devname, int part);
+
+/* bootsnap.c */
+struct bootsnap *bootsnap_load (const char *device);
+const char *bootsnap_get (struct bootsnap *s, const char *key);
+int bootsnap_set (struct bootsnap *s, const char *key, const char *value);
+int bootsnap_commit (struct bootsnap *s);
+void bootsnap_free (struct bootsnap *s);
+
+/* boothint.c */
+#define BOOTHINT_KEY	"boot_hint"
+void boothint_set (init_t *init, char *hint);
+void boothint_load (init_t *init);
+const char *boothint_disk (init_t *init, char *disk, size_t len_disk, int *part);
+void boothint_drop (init_t *init);
+void boothint_save (init_t *init);
+int boothint_rank (const char *disk);
+
+/* devnodes.c */
+void reconcile_devices (init_t *init);
+
+/* hwinv.c */
+struct hwinv_pci {
+	uint16_t	vendor;
+	uint16_t	device;
+	uint32_t	class;
+};
+struct hwinv_usb {
+	uint16_t	vendor;
+	uint16_t	product;
+};
+void hwinv_collect (void);
+void hwinv_usb_scan (void);
+char *hwinv_dmi (const char *field, char *buffer, size_t len_buf);
+int hwinv_has_pci_vendor (unsigned int vendor);
+const struct hwinv_pci *hwinv_pci_devices (int *count);
+int hwinv_export (void);
+
+/* diskprobe.c */
+struct disk_probe_set;
+struct disk_probe_set *diskprobe_open (void);
+int diskprobe_start (struct disk_probe_set *set, int (*check)(const char *name),
+		     int (*rank)(const char *name));
+int diskprobe_count (struct disk_probe_set *set);
+const char *diskprobe_name (struct disk_probe_set *set, int i);
+const char *diskprobe_wait (struct disk_probe_set *set, int i, struct disk_parts *parts,
+			    int *have_parts);
+int diskprobe_close (struct disk_probe_set *set);
+
+/* modtrace.c */
+long modtrace_now (void);
+const char *modtrace_push (const char *origin);
+void modtrace_pop (const char *prev);
+const char *modtrace_origin (void);
+void modtrace_dependency (int dep);
+void modtrace_insmod (const char *filename, long start_us, int rc);
+void modtrace_request (const char *name, long start_us, int rc);
+void modtrace_summary (init_t *init);
+
+/* modplan.c */
+void modplan_record (const char *filename);
+void modplan_replay (init_t *init);
+void modplan_load (init_t *init);
+void modplan_save (init_t *init);
+
+/* arena.c */
+struct arena_chunk;
+struct arena {
+	struct arena_chunk	*chunks;
+	size_t			total;		/* bytes allocated from malloc */
+};
+void *arena_alloc (struct arena *a, size_t size);
+char *arena_strndup (struct arena *a, const char *s, size_t len);
+char *arena_strdup (struct arena *a, const char *s);
+char *arena_printf (struct arena *a, const char *fmt, ...) __attribute__ ((format (gnu_printf, 2, 3)));
+size_t arena_release (struct arena *a);
+
+/* bin_index.c */
+struct bin_index;
+typedef int (*bin_index_cb)(const char *value, void *data);
+struct bin_index *bin_index_open (const char *filename);
+void bin_index_close (struct bin_index *idx);
+const char *bin_index_search (struct bin_index *idx, const char *key);
+int bin_index_search_wild (struct bin_index *idx, const char *key, bin_index_cb cb, void *data);
+
 /* gzip.c */
 extern int check_gz(const char * string);
 extern int compress_file(const char *srcfile, const char *trgtfile);
@@ -212,6 +346,7 @@ char *get_block_partition_data(const char *blk_dev, int part_num, const char *fi
 char *get_block_data_printf(const char *field, char *buffer, size_t len_buf, const char *format, ...) __attribute__ ((format (gnu_printf, 4, 5)));
 char *get_block_partition_data_printf(int part_num, const char *field, char *buffer, size_t len_buf, const char *format, ...) __attribute__ ((format (gnu_printf, 5, 6)));
 char *get_sysfs_entry(char *buffer, size_t len_buf, const char *format, ...) __attribute__ ((format (gnu_printf, 3, 4)));
+char *get_sysfs_attr(const char *path, char *buffer, size_t len_buf);
 
 /* string_helper.c */
 int match_n_module(const char *s1, char *s2, int n);
@@ -220,3 +355,5 @@ int search_match_module(const char *s1, char *s2);
 int match_string_nocase(const char *s1, char *s2);
 int match_string(const char *s1, char *s2);
 void remove_end_newline(char *s1);
+unsigned int hash_string(const char *s, size_t len);
+int module_ext_len(const char *name, size_t len);
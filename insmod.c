@@ -30,6 +30,10 @@
 #include <sys/stat.h>
 #include <sys/utsname.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
 #include <asm/unistd.h>
 #include <sys/syscall.h>
 #include "init.h"
@@ -51,9 +55,289 @@ static const char *moderror(int err)
 	}
 }
 
-int insmod_cmd(char *filename, struct mod_opt_t *opts)
+/* flag for finit_module() to let the kernel decompress the module itself */
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+#define MOD_COMP_NONE	0
+#define MOD_COMP_GZIP	1
+#define MOD_COMP_XZ	2
+#define MOD_COMP_ZSTD	3
+
+/* initial size of the decompression buffer, grown on demand */
+#define MOD_BUF_CHUNK	(1024 * 1024)
+
+/* decompression buffer reused across modules, a worker finding it busy
+   falls back to a private one */
+static unsigned char *mod_buf = NULL;
+static size_t mod_buf_size = 0;
+static int mod_buf_busy = 0;
+static pthread_mutex_t mod_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int module_compression(const char *filename)
+{
+	size_t len = strlen(filename);
+
+	if (len > 3 && strcmp(filename + len - 3, ".gz") == 0)
+		return MOD_COMP_GZIP;
+	if (len > 3 && strcmp(filename + len - 3, ".xz") == 0)
+		return MOD_COMP_XZ;
+	if (len > 4 && strcmp(filename + len - 4, ".zst") == 0)
+		return MOD_COMP_ZSTD;
+
+	return MOD_COMP_NONE;
+}
+
+static int grow_buffer(unsigned char **buf, size_t *size, size_t need)
+{
+	unsigned char *n;
+	size_t s = *size ? *size : MOD_BUF_CHUNK;
+
+	while (s < need)
+		s *= 2;
+	if (s == *size)
+		return 0;
+
+	n = realloc(*buf, s);
+	if (!n)
+		return -1;
+
+	*buf = n;
+	*size = s;
+	return 0;
+}
+
+/* inflate a gzip compressed module with zlib, returns the image length
+   or -1 */
+
+static long gunzip_module(int fd, unsigned char **buf, size_t *size)
+{
+	unsigned char in[16384];
+	z_stream stream;
+	size_t out = 0;
+	ssize_t rd;
+	int ret = Z_OK;
+
+	memset(&stream, 0, sizeof(stream));
+	/* 15 + 32: zlib window with automatic gzip header detection */
+	if (inflateInit2(&stream, 15 + 32) != Z_OK)
+		return -1;
+
+	while (ret != Z_STREAM_END) {
+		rd = read(fd, in, sizeof(in));
+		if (rd <= 0)
+			break;
+
+		stream.next_in = in;
+		stream.avail_in = rd;
+		do {
+			if (out == *size &&
+			    grow_buffer(buf, size, out + 1) != 0) {
+				inflateEnd(&stream);
+				return -1;
+			}
+			stream.next_out = *buf + out;
+			stream.avail_out = *size - out;
+			ret = inflate(&stream, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				inflateEnd(&stream);
+				return -1;
+			}
+			out = *size - stream.avail_out;
+		} while (stream.avail_in > 0 && ret != Z_STREAM_END);
+	}
+
+	inflateEnd(&stream);
+	if (ret != Z_STREAM_END)
+		return -1;
+
+	return (long) out;
+}
+
+/* decompress a xz compressed module with liblzma, returns the image
+   length or -1 */
+
+static long unxz_module(int fd, unsigned char **buf, size_t *size)
 {
-	int fd;
+	unsigned char in[16384];
+	lzma_stream stream = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret ret = LZMA_OK;
+	size_t out = 0;
+	ssize_t rd;
+
+	if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+		return -1;
+
+	while (ret != LZMA_STREAM_END) {
+		if (stream.avail_in == 0 && action == LZMA_RUN) {
+			rd = read(fd, in, sizeof(in));
+			if (rd < 0) {
+				ret = LZMA_DATA_ERROR;
+				break;
+			}
+			if (rd == 0)
+				action = LZMA_FINISH;
+			stream.next_in = in;
+			stream.avail_in = rd;
+		}
+		if (out == *size && grow_buffer(buf, size, out + 1) != 0) {
+			ret = LZMA_MEM_ERROR;
+			break;
+		}
+		stream.next_out = *buf + out;
+		stream.avail_out = *size - out;
+		ret = lzma_code(&stream, action);
+		out = *size - stream.avail_out;
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+			break;
+	}
+
+	lzma_end(&stream);
+	if (ret != LZMA_STREAM_END)
+		return -1;
+
+	return (long) out;
+}
+
+/* decompress a zstd compressed module with libzstd, returns the image
+   length or -1 */
+
+static long unzstd_module(int fd, unsigned char **buf, size_t *size)
+{
+	unsigned char in[16384];
+	ZSTD_DStream *stream;
+	ZSTD_inBuffer inb;
+	ZSTD_outBuffer outb;
+	size_t out = 0, ret = 1;
+	ssize_t rd;
+
+	stream = ZSTD_createDStream();
+	if (!stream)
+		return -1;
+	if (ZSTD_isError(ZSTD_initDStream(stream))) {
+		ZSTD_freeDStream(stream);
+		return -1;
+	}
+
+	while ((rd = read(fd, in, sizeof(in))) > 0) {
+		inb.src = in;
+		inb.size = rd;
+		inb.pos = 0;
+		do {
+			if (out == *size &&
+			    grow_buffer(buf, size, out + 1) != 0) {
+				ZSTD_freeDStream(stream);
+				return -1;
+			}
+			outb.dst = *buf;
+			outb.size = *size;
+			outb.pos = out;
+			ret = ZSTD_decompressStream(stream, &outb, &inb);
+			if (ZSTD_isError(ret)) {
+				ZSTD_freeDStream(stream);
+				return -1;
+			}
+			out = outb.pos;
+		/* a full output buffer may hold back more data */
+		} while (inb.pos < inb.size || out == *size);
+	}
+
+	ZSTD_freeDStream(stream);
+	/* 0: the last frame is complete */
+	if (rd < 0 || ret != 0)
+		return -1;
+
+	return (long) out;
+}
+
+/* read the image of a module file into *buf (malloc'd, grown as
+   needed), compressed modules are decompressed. Returns the image
+   length or -1 */
+
+long read_module_image(const char *filename, unsigned char **buf, size_t *size)
+{
+	size_t out = 0;
+	ssize_t rd;
+	long len;
+	int fd, comp;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	comp = module_compression(filename);
+	if (comp == MOD_COMP_GZIP) {
+		len = gunzip_module(fd, buf, size);
+	} else if (comp == MOD_COMP_XZ) {
+		len = unxz_module(fd, buf, size);
+	} else if (comp == MOD_COMP_ZSTD) {
+		len = unzstd_module(fd, buf, size);
+	} else {
+		for (;;) {
+			if (out == *size && grow_buffer(buf, size, out + 1) != 0) {
+				rd = -1;
+				break;
+			}
+			rd = read(fd, *buf + out, *size - out);
+			if (rd <= 0)
+				break;
+			out += rd;
+		}
+		len = (rd < 0) ? -1 : (long) out;
+	}
+
+	close(fd);
+	return len;
+}
+
+/* load a compressed module the kernel can not decompress itself */
+
+static long init_compressed_module(int fd, int comp, const char *options)
+{
+	unsigned char *buf = NULL;
+	size_t size = 0;
+	int shared = 0;
+	long len, ret;
+
+	pthread_mutex_lock(&mod_buf_lock);
+	if (!mod_buf_busy) {
+		mod_buf_busy = shared = 1;
+		buf = mod_buf;
+		size = mod_buf_size;
+	}
+	pthread_mutex_unlock(&mod_buf_lock);
+
+	if (comp == MOD_COMP_GZIP)
+		len = gunzip_module(fd, &buf, &size);
+	else if (comp == MOD_COMP_XZ)
+		len = unxz_module(fd, &buf, &size);
+	else
+		len = unzstd_module(fd, &buf, &size);
+
+	if (len < 0) {
+		errno = ENOEXEC;
+		ret = -1;
+	} else {
+		ret = syscall(__NR_init_module, buf, (unsigned long) len, options);
+	}
+
+	if (shared) {
+		pthread_mutex_lock(&mod_buf_lock);
+		mod_buf = buf;
+		mod_buf_size = size;
+		mod_buf_busy = 0;
+		pthread_mutex_unlock(&mod_buf_lock);
+	} else {
+		free(buf);
+	}
+
+	return ret;
+}
+
+static int insmod_load(char *filename, struct mod_opt_t *opts)
+{
+	int fd, comp, err;
 	long int ret;
 	struct stat st;
 	unsigned long len;
@@ -82,29 +366,66 @@ int insmod_cmd(char *filename, struct mod_opt_t *opts)
 		opts = opts->m_next;
 	}
 
-	if ((fd = open(filename, O_RDONLY, 0)) < 0) {
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC, 0)) < 0) {
 		msg(NULL,LOG_ERR,"insmod: can not open module '%s'\n", filename);
+		free(options);
+		return 1;
 	}
 
-	fstat(fd, &st);
-	len = st.st_size;
-	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (map == MAP_FAILED) {
-		msg(NULL,LOG_ERR,"insmod: can not mmap '%s'\n", filename);
-                free(options);
-		return 1;
+	/* let the kernel read (and decompress) the module from the file */
+	comp = module_compression(filename);
+	ret = syscall(__NR_finit_module, fd, options,
+		      comp != MOD_COMP_NONE ? MODULE_INIT_COMPRESSED_FILE : 0);
+
+	if (ret != 0 && comp != MOD_COMP_NONE &&
+	    (errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == ENOEXEC)) {
+		/* kernel without finit_module or without in-kernel
+		   decompression for this format */
+		lseek(fd, 0, SEEK_SET);
+		ret = init_compressed_module(fd, comp, options);
+	} else if (ret != 0 && errno == ENOSYS) {
+		/* kernel without finit_module */
+		fstat(fd, &st);
+		len = st.st_size;
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			msg(NULL,LOG_ERR,"insmod: can not mmap '%s'\n", filename);
+			close(fd);
+			free(options);
+			return 1;
+		}
+		ret = syscall(__NR_init_module, map, len, options);
+		err = errno;
+		munmap(map, len);
+		errno = err;
 	}
 
-	ret = syscall(__NR_init_module, map, len, options);
+	err = errno;
+	close(fd);
+	free(options);
+
 	if (ret != 0) {
 		msg(NULL,LOG_ERR,"insmod: can not insmod '%s' (errno %d): %s\n",
-				filename, errno, moderror(errno));
-                free(options);
-		if (errno == 0)
+				filename, err, moderror(err));
+		kmodule_set_state(filename, err == EEXIST ? KMOD_STATE_LOADED : KMOD_STATE_FAILED);
+		if (err == 0)
 			return 1;
-		return -errno;
+		return -err;
 	}
 
+	kmodule_set_state(filename, KMOD_STATE_LOADED);
+	modplan_record(filename);
 	return 0;
 }
 
+int insmod_cmd(char *filename, struct mod_opt_t *opts)
+{
+	long start = modtrace_now();
+	int rc;
+
+	rc = insmod_load(filename, opts);
+	if (filename)
+		modtrace_insmod(filename, start, rc);
+
+	return rc;
+}
@@ -0,0 +1,492 @@
+/*
+ * initramfs init program.
+ * record the modules loaded for a hardware model and replay them at the
+ * next boot.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include "init.h"
+
+/* The plan is kept in the boot registry of the boot device:
+ *
+ *   modplan_fp     fingerprint of the hardware (DMI, PCI ids, kernel)
+ *   modplan_cnt    number of module list chunks
+ *   modplan_<n>    comma separated module names, at most MODPLAN_CHUNK
+ *                  characters per entry
+ *
+ * It is only taken from a registry with the boot_id of the kernel command
+ * line, the same rule the boot device check applies. Modules which only
+ * drive USB devices, or are only used by such modules, are not part of
+ * the plan: they depend on what happens to be plugged in, and would make
+ * the boot flash be rewritten whenever that changes.
+ *
+ * The plan is read from the first partition of the internal disks, if it
+ * carries the IGEL signatures. USB disks are slow and not the place of a
+ * plan for the hardware. modplan_replay() looks before any module is
+ * loaded, which finds the disks of storage drivers built into the kernel.
+ * When the boot disk needs a module itself (nvme, ahci, sdhci built as
+ * modules) modplan_load() looks again while the boot device is searched,
+ * on the disks which showed up after coldplug, and loads the modules of
+ * the plan the modalias scan did not load. Each disk is read once. */
+
+#define MODPLAN_CHUNK		200
+#define MODPLAN_MAX_CHUNKS	32
+#define MODPLAN_NODE		"/dev/.modplan"
+#define MODPLAN_DISKS		32
+
+static char **plan_names = NULL;
+static int plan_count = 0;
+static int plan_max = 0;
+static int plan_recording = 0;
+static int plan_found = 0;
+static char plan_fp[16];
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cmp_string (const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* fingerprint of DMI data, the PCI vendor/device ids, the kernel
+ * release and the coldplug mode, as 8 hex digits */
+
+static void modplan_fingerprint (init_t *init, char *fp, size_t len_fp)
+{
+	static const char *dmi_fields[] = {
+		"sys_vendor", "product_name", "board_name", "bios_version", NULL
+	};
+	const struct hwinv_pci *pci;
+	char buf[256], id[16];
+	struct utsname un;
+	unsigned int h = 0;
+	int i, count;
+
+	for (i = 0; dmi_fields[i] != NULL; i++) {
+		if (hwinv_dmi(dmi_fields[i], buf, sizeof(buf)) != NULL)
+			h ^= hash_string(buf, strlen(buf)) + i;
+	}
+
+	if (uname(&un) == 0)
+		h ^= hash_string(un.release, strlen(un.release));
+
+	/* a storage-first boot loads a different set of modules */
+	if (init->coldplug_storage)
+		h ^= hash_string("storage", 7);
+
+	/* the set of ids counts, not the enumeration order: the inventory
+	   is sorted, hashed in the sysfs notation */
+	pci = hwinv_pci_devices(&count);
+	for (i = 0; i < count; i++) {
+		snprintf(id, sizeof(id), "0x%04x:0x%04x", pci[i].vendor, pci[i].device);
+		h = h * 31 + hash_string(id, strlen(id));
+	}
+
+	snprintf(fp, len_fp, "%08x", h);
+}
+
+/* remember a successfully inserted module (file name or module name) */
+
+void
+modplan_record (const char *filename)
+{
+	const char *name = strrchr(filename, '/');
+	char **n;
+	size_t len;
+	int i;
+
+	name = name ? name + 1 : filename;
+	len = strcspn(name, ".");
+
+	pthread_mutex_lock(&plan_lock);
+	if (!plan_recording)
+		goto out;
+
+	for (i = 0; i < plan_count; i++) {
+		if (strlen(plan_names[i]) == len && strncmp(plan_names[i], name, len) == 0)
+			goto out;
+	}
+
+	if (plan_count == plan_max) {
+		n = realloc(plan_names, (plan_max + 32) * sizeof(char *));
+		if (n == NULL)
+			goto out;
+		plan_names = n;
+		plan_max += 32;
+	}
+	plan_names[plan_count] = strndup(name, len);
+	if (plan_names[plan_count] != NULL)
+		plan_count++;
+out:
+	pthread_mutex_unlock(&plan_lock);
+}
+
+/* read the plan of the given bootreg snapshot, returns the module list
+ * (comma separated) if the fingerprint matches, NULL otherwise */
+
+static char *modplan_read (struct bootsnap *s, const char *fp)
+{
+	char key[32], *plan = NULL, *n;
+	const char *p;
+	size_t len = 0;
+	int i, chunks;
+
+	p = bootsnap_get(s, "modplan_fp");
+	if (p == NULL)
+		return NULL;
+	if (fp != NULL && strcmp(p, fp) != 0)
+		return NULL;
+
+	p = bootsnap_get(s, "modplan_cnt");
+	if (p == NULL)
+		return NULL;
+	chunks = atoi(p);
+	if (chunks <= 0 || chunks > MODPLAN_MAX_CHUNKS)
+		return NULL;
+
+	for (i = 0; i < chunks; i++) {
+		snprintf(key, sizeof(key), "modplan_%d", i);
+		p = bootsnap_get(s, key);
+		if (p == NULL) {
+			free(plan);
+			return NULL;
+		}
+		n = realloc(plan, len + strlen(p) + 2);
+		if (n == NULL) {
+			free(plan);
+			return NULL;
+		}
+		plan = n;
+		if (len > 0)
+			plan[len++] = ',';
+		strcpy(plan + len, p);
+		len += strlen(p);
+	}
+
+	return plan;
+}
+
+/* look for a boot registry on the first partition of the internal disks
+ * which were not read yet */
+
+static char *modplan_find (init_t *init, const char *fp)
+{
+	static char seen[MODPLAN_DISKS][32];
+	static int n_seen = 0;
+	struct dirent *dent;
+	struct bootsnap *s;
+	char name[PATH_MAX], *buf, *plan = NULL;
+	const char *p;
+	const char *prefix;
+	unsigned int major, minor;
+	DIR *dir;
+	int i;
+
+	dir = opendir("/sys/block");
+	if (dir == NULL)
+		return NULL;
+
+	while (plan == NULL && (dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.' ||
+		    strstr(dent->d_name, "ram") != NULL ||
+		    strstr(dent->d_name, "loop") != NULL ||
+		    strlen(dent->d_name) >= sizeof(seen[0]))
+			continue;
+		if (boothint_rank(dent->d_name) >= 3)
+			continue;
+		for (i = 0; i < n_seen; i++) {
+			if (strcmp(seen[i], dent->d_name) == 0)
+				break;
+		}
+		if (i < n_seen)
+			continue;
+
+		if (strncmp(dent->d_name, "mmcblk", 6) == 0 ||
+		    strncmp(dent->d_name, "nvme", 4) == 0)
+			prefix = "p";
+		else
+			prefix = "";
+
+		/* without the partition yet the disk is read next time */
+		buf = read_file(16, name, sizeof(name), "/sys/block/%s/%s%s1/dev",
+				dent->d_name, dent->d_name, prefix);
+		if (buf == NULL || sscanf(buf, "%u:%u", &major, &minor) != 2)
+			continue;
+		if (n_seen < MODPLAN_DISKS)
+			strcpy(seen[n_seen++], dent->d_name);
+
+		/* only a partition with a boot registry is opened by it */
+		if (!igel_partition(dent->d_name, 1))
+			continue;
+
+		unlink(MODPLAN_NODE);
+		if (mknod(MODPLAN_NODE, S_IFBLK | S_IRUSR | S_IWUSR,
+			  makedev(major, minor)) != 0)
+			continue;
+
+		s = bootsnap_load(MODPLAN_NODE);
+		p = s ? bootsnap_get(s, "boot_id") : NULL;
+		if (s != NULL && (init->boot_id == NULL ? p != NULL :
+				  p == NULL || strcmp(p, init->boot_id) != 0)) {
+			msg(init,LOG_INFO,"modplan: %s has another boot id\n", dent->d_name);
+			bootsnap_free(s);
+			s = NULL;
+		}
+		if (s != NULL) {
+			plan = modplan_read(s, fp);
+			/* the boot device of the last boot, see boothint.c */
+			p = bootsnap_get(s, BOOTHINT_KEY);
+			boothint_set(init, p ? strdup(p) : NULL);
+			bootsnap_free(s);
+		}
+		unlink(MODPLAN_NODE);
+	}
+	closedir(dir);
+
+	return plan;
+}
+
+/* load the modules of plan, takes over plan */
+
+static void modplan_apply (init_t *init, char *plan)
+{
+	char *p, **names = NULL, **n;
+	const char *origin;
+	int count = 0;
+
+	plan_found = 1;
+	for (p = strtok(plan, ","); p != NULL; p = strtok(NULL, ",")) {
+		n = realloc(names, (count + 1) * sizeof(char *));
+		if (n == NULL)
+			break;
+		names = n;
+		names[count++] = p;
+	}
+
+	msg(init,LOG_NOTICE," * loading %d modules known for this hardware\n", count);
+	origin = modtrace_push("plan");
+	modprobe_batch(init, (const char **) names, count);
+	modtrace_pop(origin);
+
+	free(names);
+	free(plan);
+}
+
+/* start recording and load the plan of a previous boot on the same
+ * hardware, called before the modalias scan */
+
+void
+modplan_replay (init_t *init)
+{
+	char *plan;
+
+	pthread_mutex_lock(&plan_lock);
+	plan_recording = 1;
+	pthread_mutex_unlock(&plan_lock);
+
+	modplan_fingerprint(init, plan_fp, sizeof(plan_fp));
+
+	plan = modplan_find(init, plan_fp);
+	if (plan == NULL) {
+		msg(init,LOG_INFO,"modplan: no module plan for hardware %s yet\n", plan_fp);
+		return;
+	}
+	modplan_apply(init, plan);
+}
+
+/* look for the plan on the disks which showed up since modplan_replay(),
+ * does nothing once a plan was loaded */
+
+void
+modplan_load (init_t *init)
+{
+	char *plan;
+
+	if (plan_found || plan_fp[0] == '\0')
+		return;
+
+	plan = modplan_find(init, plan_fp);
+	if (plan != NULL)
+		modplan_apply(init, plan);
+}
+
+/* 1 if the module only drives USB devices or is only used by such
+ * modules, name as recorded */
+
+static int modplan_usb_only (const char *name, int depth)
+{
+	char path[PATH_MAX], mod[NAME_MAX + 1];
+	struct dirent *dent;
+	DIR *dir;
+	int usb = 0, other = 0;
+	size_t i;
+
+	if (depth > 4)
+		return 0;
+
+	/* sysfs knows the modules with '_' */
+	for (i = 0; name[i] != '\0' && i < sizeof(mod) - 1; i++)
+		mod[i] = (name[i] == '-') ? '_' : name[i];
+	mod[i] = '\0';
+
+	/* drivers/ has an entry <bus>:<driver> per driver of the module */
+	snprintf(path, sizeof(path), "/sys/module/%s/drivers", mod);
+	dir = opendir(path);
+	if (dir != NULL) {
+		while ((dent = readdir(dir)) != NULL) {
+			if (dent->d_name[0] == '.')
+				continue;
+			if (strncmp(dent->d_name, "usb:", 4) == 0)
+				usb++;
+			else
+				other++;
+		}
+		closedir(dir);
+		if (usb > 0 || other > 0)
+			return (other == 0);
+	}
+
+	/* without drivers: a library, look at the modules using it */
+	snprintf(path, sizeof(path), "/sys/module/%s/holders", mod);
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+		if (modplan_usb_only(dent->d_name, depth + 1))
+			usb++;
+		else
+			other++;
+	}
+	closedir(dir);
+
+	return (usb > 0 && other == 0);
+}
+
+/* store the modules recorded up to now in the boot registry snapshot of
+ * the boot partition, it is only changed if the set of modules changed */
+
+void
+modplan_save (init_t *init)
+{
+	char fp[16], key[32], value[16], *old, *p, **sorted, **names;
+	size_t len;
+	int i, count, chunks, same = 0;
+
+	pthread_mutex_lock(&plan_lock);
+	plan_recording = 0;
+	pthread_mutex_unlock(&plan_lock);
+
+	if (plan_count == 0 || init->bootsnap == NULL)
+		return;
+
+	modplan_fingerprint(init, fp, sizeof(fp));
+
+	/* leave out the modules of plugged in USB devices */
+	names = malloc(plan_count * sizeof(char *));
+	if (names == NULL)
+		return;
+	for (i = 0, count = 0; i < plan_count; i++) {
+		if (!modplan_usb_only(plan_names[i], 0))
+			names[count++] = plan_names[i];
+	}
+	if (count == 0) {
+		free(names);
+		return;
+	}
+
+	/* compare as sets, parallel loading does not keep the order */
+	sorted = malloc(count * sizeof(char *));
+	if (sorted == NULL) {
+		free(names);
+		return;
+	}
+	memcpy(sorted, names, count * sizeof(char *));
+	qsort(sorted, count, sizeof(char *), cmp_string);
+
+	old = modplan_read(init->bootsnap, fp);
+	if (old != NULL) {
+		char **oldnames = NULL, **n;
+		int n_old = 0;
+
+		for (p = strtok(old, ","); p != NULL; p = strtok(NULL, ",")) {
+			n = realloc(oldnames, (n_old + 1) * sizeof(char *));
+			if (n == NULL)
+				break;
+			oldnames = n;
+			oldnames[n_old++] = p;
+		}
+		if (n_old == count) {
+			qsort(oldnames, n_old, sizeof(char *), cmp_string);
+			for (i = 0; i < n_old; i++) {
+				if (strcmp(oldnames[i], sorted[i]) != 0)
+					break;
+			}
+			same = (i == n_old);
+		}
+		free(oldnames);
+		free(old);
+	}
+	free(sorted);
+
+	if (same) {
+		free(names);
+		return;
+	}
+
+	/* fill chunks in load order */
+	p = malloc(MODPLAN_CHUNK + 1);
+	chunks = 0;
+	for (i = 0; p != NULL && i < count && chunks < MODPLAN_MAX_CHUNKS; ) {
+		len = 0;
+		p[0] = '\0';
+		while (i < count && len + strlen(names[i]) + 1 <= MODPLAN_CHUNK) {
+			if (len > 0)
+				p[len++] = ',';
+			strcpy(p + len, names[i]);
+			len += strlen(names[i]);
+			i++;
+		}
+		if (len == 0) {
+			/* a name longer than a chunk */
+			i++;
+			continue;
+		}
+		snprintf(key, sizeof(key), "modplan_%d", chunks++);
+		bootsnap_set(init->bootsnap, key, p);
+	}
+	free(p);
+	free(names);
+
+	snprintf(value, sizeof(value), "%d", chunks);
+	bootsnap_set(init->bootsnap, "modplan_cnt", value);
+	bootsnap_set(init->bootsnap, "modplan_fp", fp);
+
+	msg(init,LOG_INFO,"modplan: stored %d modules for hardware %s\n", count, fp);
+}
@@ -29,28 +29,47 @@
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fnmatch.h>
 #include "init.h"
 
 struct dep_t {	/* one-way list of dependency rules */
 	/* a dependency rule */
-	char *  m_name;				/* the module name*/
-	char *  m_path;				/* the module file path */
+	char *  m_name;				/* the module name, points into the mapping */
+	char *  m_path;				/* the module file path, built on first use */
+	const char * m_relpath;			/* the path in modules.dep without extension */
+	char    m_ext[8];			/* the module file extension */
 	struct mod_opt_t *  m_options;	/* the module options */
 
 	int     m_isalias  : 1;			/* the module is an alias */
-	int     m_reserved : 15;		/* stuffin' */
+	int     m_denied   : 1;			/* "install <module> /bin/false" */
+	int     m_reserved : 14;		/* stuffin' */
 
 	int     m_depcnt   : 16;		/* the number of dependable module(s) */
-	char ** m_deparr;			/* the list of dependable module(s) */
+	const char * m_base;			/* mapping the m_deparr offsets point into */
+	uint32_t * m_deparr;			/* the list of dependable module(s) */
+	struct mod_opt_t *  m_pre;		/* softdep modules to load before */
+	struct mod_opt_t *  m_post;		/* softdep modules to load after */
 
 	struct dep_t * m_next;			/* the next dependency rule */
+	struct dep_t * m_hnext;			/* the next rule in the same hash bucket */
 };
 
+/* the name of the i-th dependable module of a rule */
+#define dep_name(dt, i)	((dt)-> m_base + (dt)-> m_deparr [i])
+
 struct mod_list_t {	/* two-way list of modules to process */
 	/* a module description */
 	char *  m_name;
 	char *  m_path;
 	struct mod_opt_t *  m_options;
+	int     m_isdep;			/* only needed by another module */
 
 	struct mod_list_t * m_prev;
 	struct mod_list_t * m_next;
@@ -58,6 +77,34 @@ struct mod_list_t {	/* two-way list of modules to process */
 
 
 static struct dep_t *depend = NULL;
+static struct dep_t *depend_tail = NULL;
+static int depend_ready = 0;
+
+/* modules.dep.bin, rules are read from it on first use */
+static struct bin_index *dep_bin = NULL;
+
+/* dependency rules by module name, '-' and '_' are equivalent */
+#define DEP_HASH_SIZE	2048
+static struct dep_t *dep_hash [DEP_HASH_SIZE];
+
+static char dep_dirname [255];
+
+/* all rules, options and module lists live in dep_arena until
+   modprobe_release() */
+static struct arena dep_arena;
+
+struct dep_map_t {	/* a mapped file the rules point into */
+	void *  m_addr;
+	size_t  m_len;
+	struct dep_map_t * m_next;
+};
+static struct dep_map_t *dep_maps = NULL;
+
+#define MODPROBE_CONF	"/etc/modprobe.conf"
+#define MODPROBE_CONF_DIR	"/etc/modprobe.d"
+
+/* "blacklist" patterns, '-' folded to '_' */
+static struct mod_opt_t *blacklist = NULL;
 
 #define main_options "acdklnqrst:vVC:"
 #define INSERT_ALL     1        /* a */
@@ -104,35 +151,6 @@ static int parse_tag_value ( char *buffer, char **ptag, char **pvalue )
 	return 1;
 }
 
-/* Jump through hoops to simulate how fgets() grabs just one line at a
- * time... Don't use any stdio since modprobe gets called from a kernel
- * thread and stdio junk can overflow the limited stack...
- */
-static char *reads ( int fd, char *buffer, size_t len )
-{
-	int n = read ( fd, buffer, len );
-
-	if ( n > 0 ) {
-		char *p;
-
-		buffer [len-1] = 0;
-		p = strchr ( buffer, '\n' );
-
-		if ( p ) {
-			off_t offset;
-
-			offset = lseek ( fd, 0L, SEEK_CUR );               // Get the current file descriptor offset
-			lseek ( fd, offset-n + (p-buffer) + 1, SEEK_SET ); // Set the file descriptor offset to right after the \n
-
-			p[1] = 0;
-		}
-		return buffer;
-	}
-
-	else
-		return 0;
-}
-
 /*
  * This function appends an option to a list
  */
@@ -144,13 +162,15 @@ static struct mod_opt_t *append_option( struct mod_opt_t *opt_list, char *opt )
 		while( ol-> m_next ) {
 			ol = ol-> m_next;
 		}
-		ol-> m_next = malloc( sizeof( struct mod_opt_t ) );
+		ol-> m_next = arena_alloc( &dep_arena, sizeof( struct mod_opt_t ) );
 		ol = ol-> m_next;
 	} else {
-		ol = opt_list = malloc( sizeof( struct mod_opt_t ) );
+		ol = opt_list = arena_alloc( &dep_arena, sizeof( struct mod_opt_t ) );
 	}
+	if ( !ol )
+		return opt_list;
 
-	ol-> m_opt_val = strdup( opt );
+	ol-> m_opt_val = arena_strdup( &dep_arena, opt );
 	ol-> m_next = NULL;
 
 	return opt_list;
@@ -158,265 +178,535 @@ static struct mod_opt_t *append_option( struct mod_opt_t *opt_list, char *opt )
 
 #define parse_command_string(src, dst)	(0)
 
+/* '-' is folded to '_' before hashing, longer names hash by their prefix */
+static unsigned int dep_hash_name ( const char *name )
+{
+	char key[64];
+	size_t i;
+
+	for ( i = 0; i + 1 < sizeof( key ) && name [i]; i++ )
+		key [i] = ( name [i] == '-' ) ? '_' : name [i];
+
+	return hash_string ( key, i ) % DEP_HASH_SIZE;
+}
+
+static int dep_name_eq ( const char *a, const char *b )
+{
+	for ( ; *a && *b; a++, b++ ) {
+		if ( *a != *b &&
+		     !(( *a == '-' || *a == '_' ) && ( *b == '-' || *b == '_' )))
+			return 0;
+	}
+	return *a == *b;
+}
+
+static struct dep_t *dep_load_bin ( const char *name );
+
+static struct dep_t *dep_find ( const char *name )
+{
+	struct dep_t *dt;
+
+	for ( dt = dep_hash [dep_hash_name ( name )]; dt; dt = dt-> m_hnext ) {
+		if ( dep_name_eq ( dt-> m_name, name ))
+			return dt;
+	}
+	if ( dep_bin )
+		return dep_load_bin ( name );
+	return NULL;
+}
+
+static void dep_append ( struct dep_t *dt )
+{
+	if ( depend_tail )
+		depend_tail-> m_next = dt;
+	else
+		depend = dt;
+	depend_tail = dt;
+}
+
+/* adds a rule to the hash table, the first rule for a name wins */
+static int dep_insert ( struct dep_t *dt )
+{
+	unsigned int h = dep_hash_name ( dt-> m_name );
+	struct dep_t *find;
+
+	for ( find = dep_hash [h]; find; find = find-> m_hnext ) {
+		if ( dep_name_eq ( find-> m_name, dt-> m_name ))
+			return 0;
+	}
+	dt-> m_hnext = dep_hash [h];
+	dep_hash [h] = dt;
+	return 1;
+}
+
+/* the absolute path of a module, the rules only keep the path from modules.dep */
+static char *dep_path ( struct dep_t *dt )
+{
+	if ( !dt-> m_path && dt-> m_relpath ) {
+		if ( dt-> m_relpath [0] == '/' ) /* old style deps - absolute path specified */
+			dt-> m_path = arena_printf ( &dep_arena, "%s%s", dt-> m_relpath, dt-> m_ext );
+		else
+			dt-> m_path = arena_printf ( &dep_arena, "%s/%s%s", dep_dirname,
+						     dt-> m_relpath, dt-> m_ext );
+		if ( !dt-> m_path )
+			msg(NULL,LOG_ERR,"modprobe: "
+			  "Could not allocate memory for module path.\n");
+	}
+	return dt-> m_path;
+}
+
 /*
- * This function builds a list of dependency rules from /lib/modules/`uname -r\modules.dep.
- * It then fills every modules and aliases with their  default options, found by parsing
- * modprobe.conf (or modules.conf, or conf.modules).
+ * Maps a file private and writable, so the parsers can terminate strings in
+ * place. The returned buffer is always followed by a 0 byte.
  */
-static struct dep_t *build_dep ( void )
+static char *map_file ( const char *filename, size_t *len )
 {
+	struct dep_map_t *dm;
+	struct stat st;
+	char *buf;
+	ssize_t rd;
+	size_t done = 0;
 	int fd;
-	struct utsname un;
-	struct dep_t *first = 0;
-	struct dep_t *current = 0;
-	char buffer[2048];
-	char *filename;
-	char dirname[255];
-	int continuation_line = 0;
 
-	if ( uname ( &un )) {
-		msg(NULL,LOG_EMERG,"modprobe: can not get kernel version\n");
+	if (( fd = open ( filename, O_RDONLY | O_CLOEXEC )) < 0 )
 		return NULL;
-	}
 
-	snprintf(dirname, 255, "/lib/modules/%s", un.release);
-	filename = malloc(255);
-	if (filename) {
-		snprintf(filename,255,"%.241s/modules.dep", dirname);
-		
-		if (( fd = open ( filename, O_RDONLY )) < 0 ) {
-
-			/* Ok, that didn't work.  Fall back to looking in /lib/modules */
-			if (( fd = open ( "/lib/modules/modules.dep", O_RDONLY )) < 0 ) {
+	if ( fstat ( fd, &st ) != 0 || st. st_size == 0 ) {
+		close ( fd );
+		return NULL;
+	}
+	*len = st. st_size;
+
+	/* the rest of the last page is zero filled, unless there is none */
+	if ( *len % sysconf ( _SC_PAGESIZE ) != 0 ) {
+		buf = mmap ( NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+		if ( buf != MAP_FAILED ) {
+			close ( fd );
+			/* unmapped by modprobe_release() */
+			dm = arena_alloc ( &dep_arena, sizeof ( struct dep_map_t ));
+			if ( !dm ) {
+				munmap ( buf, *len );
 				return NULL;
 			}
-		}
-		free(filename);
-	} else {
-		/* Ok, that didn't work.  Fall back to looking in /lib/modules */
-		if (( fd = open ( "/lib/modules/modules.dep", O_RDONLY )) < 0 ) {
-			return NULL;
+			dm-> m_addr = buf;
+			dm-> m_len = *len;
+			dm-> m_next = dep_maps;
+			dep_maps = dm;
+			return buf;
 		}
 	}
-	while ( reads ( fd, buffer, sizeof( buffer ))) {
-		int l = strlen ( buffer );
-		char *p = 0;
 
-		while ( l > 0 && isspace ( buffer [l-1] )) {
-			buffer [l-1] = 0;
-			l--;
+	/* zero filled by the arena */
+	buf = arena_alloc ( &dep_arena, *len + 1 );
+	while ( buf && done < *len ) {
+		rd = read ( fd, buf + done, *len - done );
+		if ( rd <= 0 ) {
+			buf = NULL;
+			break;
 		}
+		done += rd;
+	}
+	close ( fd );
 
-		if ( l == 0 ) {
-			continuation_line = 0;
-			continue;
-		}
+	return buf;
+}
 
-		/* Is this a new module dep description? */
-		if ( !continuation_line ) {
-			/* find the dep beginning */
-			char *col = strchr ( buffer, ':' );
-			char *dot = col;
-
-			if ( col ) {
-				/* This line is a dep description */
-				char *mods;
-				char *modpath;
-				char *mod;
-
-				/* Find the beginning of the module file name */
-				*col = 0;
-				mods = strrchr ( buffer, '/' );
-
-				if ( !mods )
-					mods = buffer; /* no path for this module */
-				else
-					mods++; /* there was a path for this module... */
-
-				/* find the path of the module */
-				if ('/' == buffer[0]) {	/* old style deps - absolute path specified */
-					modpath = strdup(buffer);
-				}
-				else { /* make an absolute path */
-					if (asprintf(&modpath, "%s/%s", dirname, buffer) < 0) {
-						msg(NULL,LOG_ERR,"modprobe: "
-						  "Could not allocate memory for module path.\n");
-						continue;
-					}
-				}
-				/* find the end of the module name in the file name
-				   ending with extension ".ko" */
-				if ( ( *(col-3) == '.' ) &&
-				     ( *(col-2) == 'k' ) && ( *(col-1) == 'o' ) )
-					dot = col - 3;
+/*
+ * Returns the end of the (logical) line starting at p and terminates it,
+ * lines ending with '\' are joined with the following line.
+ */
+static char *next_line ( char *p, char *end )
+{
+	char *eol = memchr ( p, '\n', end - p );
 
-				mod = strndup ( mods, dot - mods );
+	while ( eol && eol > p && eol [-1] == '\\' ) {
+		eol [-1] = ' ';
+		*eol = ' ';
+		eol = memchr ( eol + 1, '\n', end - eol - 1 );
+	}
+	if ( !eol )
+		return end;
 
-				/* enqueue new module */
-				if ( !current ) {
-					first = current = (struct dep_t *) malloc ( sizeof ( struct dep_t ));
-				}
-				else {
-					current-> m_next = (struct dep_t *) malloc ( sizeof ( struct dep_t ));
-					current = current-> m_next;
-				}
-				current-> m_name  = mod;
-				current-> m_path  = modpath; /* modpath was already allocated */
-				current-> m_options = NULL;
-				current-> m_isalias = 0;
-				current-> m_depcnt  = 0;
-				current-> m_deparr  = 0;
-				current-> m_next    = 0;
-
-				p = col + 1;
-			}
-			else
-				/* this line is not a dep description */
-				p = 0;
-		}
-		else
-			/* It's a dep description continuation */
-			p = buffer;
+	*eol = 0;
+	return eol;
+}
+
+/*
+ * Parses one "path: dep dep ..." line of modules.dep into a rule. Names and
+ * dependencies are terminated in place, dependencies are kept as offsets
+ * into the mapping.
+ */
+static int parse_dep_line ( char *map, char *line, struct dep_t *dt )
+{
+	char *col, *p, *tok, *base;
+	int ext, cnt;
+
+	while ( isspace ( *line ))
+		line++;
 
-		while ( p && *p && isblank(*p))
+	col = strchr ( line, ':' );
+	if ( !col || col == line )
+		return 0;
+	*col = 0;
+
+	/* find the end of the module name in the file name
+	   ending with extension ".ko" (or compressed ".ko.xz", ...) */
+	ext = module_ext_len ( line, col - line );
+	memcpy ( dt-> m_ext, col - ext, ext );
+	dt-> m_ext [ext] = 0;
+	*(col - ext) = 0;
+
+	dt-> m_relpath = line;
+	dt-> m_name = strrchr ( line, '/' );
+	if ( dt-> m_name )
+		dt-> m_name++; /* there was a path for this module... */
+	else
+		dt-> m_name = line; /* no path for this module */
+	dt-> m_base = map;
+
+	/* count the dependable modules */
+	cnt = 0;
+	for ( p = col + 1; *p; ) {
+		while ( isspace ( *p ))
 			p++;
+		if ( !*p )
+			break;
+		cnt++;
+		while ( *p && !isspace ( *p ))
+			p++;
+	}
+	if ( cnt == 0 )
+		return 1;
 
-		/* p points to the first dependable module; if NULL, no dependable module */
-		if ( p && *p ) {
-			char *end = &buffer [l-1];
-			char *deps;
-			char *dep;
-			char *next;
-			int ext = 0;
-
-			while ( isblank ( *end ) || ( *end == '\\' ))
-				end--;
-
-			do
-			{
-				/* search the end of the dependency */
-				next = strchr (p, ' ' );
-				if (next)
-				{
-					*next = 0;
-					next--;
-				}
-				else
-					next = end;
+	dt-> m_deparr = arena_alloc ( &dep_arena, cnt * sizeof ( uint32_t ));
+	if ( !dt-> m_deparr )
+		return 1;
 
-				/* find the beginning of the module file name */
-				deps = strrchr ( p, '/' );
+	for ( p = col + 1; *p; ) {
+		while ( isspace ( *p ))
+			p++;
+		if ( !*p )
+			break;
 
-				if ( !deps || ( deps < p )) {
-					deps = p;
+		tok = base = p;
+		while ( *p && !isspace ( *p )) {
+			if ( *p == '/' )
+				base = p + 1;
+			p++;
+		}
+		if ( *p )
+			*p++ = 0;
 
-					while ( isblank ( *deps ))
-						deps++;
-				}
-				else
-					deps++;
+		ext = module_ext_len ( tok, strlen ( tok ));
+		tok [strlen ( tok ) - ext] = 0;
+		if ( *base )
+			dt-> m_deparr [dt-> m_depcnt++] = base - map;
+	}
+	return 1;
+}
 
-				/* find the end of the module name in the file name,
-				   ending with extension ".ko" */
-				if ( ( *(next-2) == '.' ) &&
-				     ( *(next-1) == 'k' )  && ( *next == 'o' ) )
-					ext = 3;
+/*
+ * Looks up a module in modules.dep.bin, the value is the modules.dep line
+ * of the module.
+ */
+static struct dep_t *dep_load_bin ( const char *name )
+{
+	const char *value;
+	struct dep_t *dt;
+	char *line;
 
-				/* Cope with blank lines */
-				if ((next-deps-ext+1) <= 0)
-					continue;
-				dep = strndup ( deps, next - deps - ext + 1 );
+	value = bin_index_search ( dep_bin, name );
+	if ( !value )
+		return NULL;
 
-				/* Add the new dependable module name */
-				current-> m_depcnt++;
-				current-> m_deparr = (char **) realloc ( current-> m_deparr,
-						sizeof ( char *) * current-> m_depcnt );
-				current-> m_deparr [current-> m_depcnt - 1] = dep;
+	dt = (struct dep_t *) arena_alloc ( &dep_arena, sizeof ( struct dep_t ));
+	line = arena_strdup ( &dep_arena, value );
+	if ( !dt || !line || !parse_dep_line ( line, line, dt ) || !dep_insert ( dt ))
+		return NULL;
+	dep_append ( dt );
 
-				p = next + 2;
-			} while (next < end);
-		}
+	return dt;
+}
 
-		/* is there other dependable module(s) ? */
-		if ( buffer [l-1] == '\\' )
-			continuation_line = 1;
-		else
-			continuation_line = 0;
+/*
+ * Folds '-' to '_' outside of [] character classes, so names and patterns
+ * compare like the kernel does.
+ */
+static void normalize_name ( char *s )
+{
+	int bracket = 0;
+
+	for ( ; *s; s++ ) {
+		if ( *s == '[' )
+			bracket = 1;
+		else if ( *s == ']' )
+			bracket = 0;
+		else if ( *s == '-' && !bracket )
+			*s = '_';
 	}
-	close ( fd );
+}
 
+/*
+ * Parses "pre: mod ... post: mod ..." of a softdep line into the lists of
+ * the rule.
+ */
+static void parse_softdep ( struct dep_t *dt, char *p )
+{
+	struct mod_opt_t **list = NULL;
+	char *tok;
+
+	while ( *p ) {
+		while ( isspace ( *p ))
+			p++;
+		if ( !*p )
+			break;
+		tok = p;
+		while ( *p && !isspace ( *p ))
+			p++;
+		if ( *p )
+			*p++ = 0;
+
+		if ( strcmp ( tok, "pre:" ) == 0 )
+			list = &dt-> m_pre;
+		else if ( strcmp ( tok, "post:" ) == 0 )
+			list = &dt-> m_post;
+		else if ( list )
+			*list = append_option ( *list, tok );
+	}
+}
+
+/*
+ * Reads "alias", "options", "blacklist", "install" and "softdep" lines of
+ * the modprobe configuration.
+ */
+static void parse_conf ( const char *filename )
+{
+	struct dep_t *dt;
+	char *map, *end, *line, *eol, *p;
+	size_t len;
+
+	map = map_file ( filename, &len );
+	if ( !map )
+		return;
+	end = map + len;
 
-	continuation_line = 0;
-	while ( reads ( fd, buffer, sizeof( buffer ))) {
-		int l;
-		char *p;
+	for ( line = map; line < end; line = eol + 1 ) {
+		eol = next_line ( line, end );
 
-		p = strchr ( buffer, '#' );
+		p = strchr ( line, '#' );
 		if ( p )
 			*p = 0;
 
-		l = strlen ( buffer );
+		p = line + strlen ( line );
+		while ( p > line && isspace ( p [-1] ))
+			*--p = 0;
 
-		while ( l && isspace ( buffer [l-1] )) {
-			buffer [l-1] = 0;
-			l--;
-		}
-
-		if ( l == 0 ) {
-			continuation_line = 0;
+		if ( p == line )
 			continue;
-		}
 
-		if ( !continuation_line ) {
-			if (( strncmp ( buffer, "alias", 5 ) == 0 ) && isspace ( buffer [5] )) {
-				char *alias, *mod;
+		if (( strncmp ( line, "alias", 5 ) == 0 ) && isspace ( line [5] )) {
+			char *alias, *mod;
 
-				if ( parse_tag_value ( buffer + 6, &alias, &mod )) {
-					/* handle alias as a module dependent on the aliased module */
-					if ( !current ) {
-						first = current = (struct dep_t *) calloc ( 1, sizeof ( struct dep_t ));
-					}
-					else {
-						current-> m_next = (struct dep_t *) calloc ( 1, sizeof ( struct dep_t ));
-						current = current-> m_next;
-					}
-					current-> m_name  = strdup ( alias );
-					current-> m_isalias = 1;
-
-					if (( strcmp ( mod, "off" ) == 0 ) || ( strcmp ( mod, "null" ) == 0 )) {
-						current-> m_depcnt = 0;
-						current-> m_deparr = 0;
-					}
-					else {
-						current-> m_depcnt  = 1;
-						current-> m_deparr  = malloc ( 1 * sizeof( char * ));
-						current-> m_deparr[0] = strdup ( mod );
+			/* a module of the same name wins */
+			if ( parse_tag_value ( line + 6, &alias, &mod ) && !dep_find ( alias )) {
+				/* handle alias as a module dependent on the aliased module */
+				dt = (struct dep_t *) arena_alloc ( &dep_arena, sizeof ( struct dep_t ));
+				if ( !dt )
+					continue;
+				dt-> m_name  = alias;
+				dt-> m_isalias = 1;
+				dt-> m_base = map;
+
+				if (( strcmp ( mod, "off" ) != 0 ) && ( strcmp ( mod, "null" ) != 0 )) {
+					dt-> m_deparr = arena_alloc ( &dep_arena, sizeof ( uint32_t ));
+					if ( dt-> m_deparr ) {
+						dt-> m_depcnt = 1;
+						dt-> m_deparr [0] = mod - map;
 					}
-					current-> m_next    = 0;
 				}
+				if ( !dep_insert ( dt ))
+					continue;
+				dep_append ( dt );
 			}
-			else if (( strncmp ( buffer, "options", 7 ) == 0 ) && isspace ( buffer [7] )) {
-				char *mod, *opt;
-
-				/* split the line in the module/alias name, and options */
-				if ( parse_tag_value ( buffer + 8, &mod, &opt )) {
-					struct dep_t *dt;
-
-					/* find the corresponding module */
-					for ( dt = first; dt; dt = dt-> m_next ) {
-						if ( strcmp ( dt-> m_name, mod ) == 0 )
-							break;
-					}
-					if ( dt ) {
-						dt-> m_options = append_option( dt-> m_options, opt );
-					}
+		}
+		else if (( strncmp ( line, "options", 7 ) == 0 ) && isspace ( line [7] )) {
+			char *mod, *opt;
+
+			/* split the line in the module/alias name, and options */
+			if ( parse_tag_value ( line + 8, &mod, &opt )) {
+				/* find the corresponding module */
+				dt = dep_find ( mod );
+				if ( dt ) {
+					dt-> m_options = append_option( dt-> m_options, opt );
 				}
 			}
 		}
+		else if (( strncmp ( line, "blacklist", 9 ) == 0 ) && isspace ( line [9] )) {
+			p = line + 10;
+			while ( isspace ( *p ))
+				p++;
+			if ( *p ) {
+				if ( !strchr ( p, '/' ))
+					normalize_name ( p );
+				blacklist = append_option ( blacklist, p );
+			}
+		}
+		else if (( strncmp ( line, "install", 7 ) == 0 ) && isspace ( line [7] )) {
+			char *mod, *cmd, *prog;
+
+			/* there is no shell to run install commands, only the
+			   common way of disabling a module is understood */
+			if ( parse_tag_value ( line + 8, &mod, &cmd )) {
+				cmd [strcspn ( cmd, " \t" )] = 0;
+				prog = strrchr ( cmd, '/' );
+				prog = prog ? prog + 1 : cmd;
+				dt = dep_find ( mod );
+				if ( dt && ( strcmp ( prog, "false" ) == 0 || strcmp ( prog, "true" ) == 0 ))
+					dt-> m_denied = 1;
+				else if ( dt )
+					msg(NULL,LOG_INFO,"modprobe: ignoring install command for %s\n", mod);
+			}
+		}
+		else if (( strncmp ( line, "softdep", 7 ) == 0 ) && isspace ( line [7] )) {
+			char *mod, *deps;
+
+			if ( parse_tag_value ( line + 8, &mod, &deps )) {
+				dt = dep_find ( mod );
+				if ( dt )
+					parse_softdep ( dt, deps );
+			}
+		}
 	}
-	close ( fd );
+}
+
+static int conf_filter ( const struct dirent *dent )
+{
+	size_t len = strlen ( dent-> d_name );
+
+	return len > 5 && strcmp ( dent-> d_name + len - 5, ".conf" ) == 0;
+}
+
+/*
+ * Reads modprobe.conf, modules.softdep and the files of modprobe.d in
+ * alphabetical order.
+ */
+static void parse_conf_all ( void )
+{
+	struct dirent **files;
+	char filename [PATH_MAX];
+	int i, n;
+
+	parse_conf ( MODPROBE_CONF );
+
+	/* "softdep" of the modules themselves, written by depmod */
+	snprintf ( filename, sizeof ( filename ), "%s/modules.softdep", dep_dirname );
+	parse_conf ( filename );
 
-	return first;
+	n = scandir ( MODPROBE_CONF_DIR, &files, conf_filter, alphasort );
+	for ( i = 0; i < n; i++ ) {
+		snprintf ( filename, sizeof ( filename ), "%s/%s", MODPROBE_CONF_DIR, files [i]-> d_name );
+		parse_conf ( filename );
+		free ( files [i] );
+	}
+	if ( n >= 0 )
+		free ( files );
+}
+
+/*
+ * Returns 1 if the module of a rule matches a "blacklist" pattern. Patterns
+ * containing a '/' match the path in modules.dep and its directories (e.g.
+ * kernel/sound for all sound drivers), all others the module name.
+ */
+static int dep_blacklisted ( const char *name, const char *relpath )
+{
+	struct mod_opt_t *bl;
+	char key [256];
+
+	snprintf ( key, sizeof ( key ), "%s", name );
+	normalize_name ( key );
+
+	for ( bl = blacklist; bl; bl = bl-> m_next ) {
+		if ( strchr ( bl-> m_opt_val, '/' )) {
+			if ( relpath && fnmatch ( bl-> m_opt_val, relpath, FNM_LEADING_DIR ) == 0 )
+				return 1;
+		}
+		else if ( fnmatch ( bl-> m_opt_val, key, 0 ) == 0 )
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * This function builds the dependency rules from /lib/modules/`uname -r\modules.dep.
+ * If depmod wrote modules.dep.bin rules are looked up in it on first use,
+ * otherwise modules.dep is mapped and parsed in one pass into a hash table of rules.
+ * It then fills every modules and aliases with their default options, found by parsing
+ * modprobe.conf.
+ * Returns 0 on success.
+ */
+static int build_dep ( void )
+{
+	struct utsname un;
+	struct dep_t *entries;
+	char filename [255];
+	char *map, *end, *line, *eol;
+	size_t len, lines = 1, count = 0;
+
+	if ( uname ( &un )) {
+		msg(NULL,LOG_EMERG,"modprobe: can not get kernel version\n");
+		return -1;
+	}
+
+	snprintf(dep_dirname, sizeof(dep_dirname), "/lib/modules/%s", un.release);
+	memset ( dep_hash, 0, sizeof ( dep_hash ));
+	depend = depend_tail = NULL;
+
+	snprintf(filename, sizeof(filename), "%.237s/modules.dep.bin", dep_dirname);
+	dep_bin = bin_index_open ( filename );
+	if ( dep_bin ) {
+		parse_conf_all ( );
+		return 0;
+	}
+
+	snprintf(filename, sizeof(filename), "%.241s/modules.dep", dep_dirname);
+
+	map = map_file ( filename, &len );
+	if ( !map ) {
+		/* Ok, that didn't work.  Fall back to looking in /lib/modules */
+		map = map_file ( "/lib/modules/modules.dep", &len );
+		if ( !map )
+			return -1;
+	}
+	end = map + len;
+
+	/* one rule per line at most */
+	for ( line = map; ( line = memchr ( line, '\n', end - line )); line++ )
+		lines++;
+	entries = arena_alloc ( &dep_arena, lines * sizeof ( struct dep_t ));
+	if ( !entries )
+		return -1;
+
+	for ( line = map; line < end; line = eol + 1 ) {
+		eol = next_line ( line, end );
+
+		if ( !parse_dep_line ( map, line, &entries [count] ))
+			continue;
+		if ( !dep_insert ( &entries [count] )) {
+			memset ( &entries [count], 0, sizeof ( struct dep_t ));
+			continue;
+		}
+		dep_append ( &entries [count] );
+		count++;
+	}
+
+	if ( count == 0 ) {
+		depend = depend_tail = NULL;
+		return -1;
+	}
+
+	parse_conf_all ( );
+
+	return 0;
 }
 
 static int mod_process ( struct mod_list_t *list, int do_insert )
@@ -426,7 +716,9 @@ static int mod_process ( struct mod_list_t *list, int do_insert )
 	while ( list ) {
 		if ( do_insert ) {
 			if (kmodule_already_loaded (NULL, list->m_name) != 1) {
+				modtrace_dependency ( list-> m_isdep );
 				rc = insmod_cmd(list->m_path, list->m_options);
+				modtrace_dependency ( 0 );
 			}
 		} else {
 			/* modutils uses short name for removal */
@@ -440,37 +732,31 @@ static int mod_process ( struct mod_list_t *list, int do_insert )
 }
 
 /*
- * Builds the dependency list (aka stack) of a module.
- * head: the highest module in the stack (last to insmod, first to rmmod)
- * tail: the lowest module in the stack (first to insmod, last to rmmod)
+ * Looks up a module in the dependency rules and resolves alias names.
+ * Options of an alias are appended to the options of the aliased module.
  */
-static void check_dep (const char *mod, struct mod_list_t **head, struct mod_list_t **tail )
+static struct dep_t *resolve_dep (const char *mod )
 {
-	struct mod_list_t *find;
 	struct dep_t *dt;
-	struct mod_opt_t *opt = 0;
-	char *path = 0;
 
 	// check dependencies
-	for ( dt = depend; dt; dt = dt-> m_next ) {
-		if ( strcmp ( dt-> m_name, mod ) == 0) {
-			break;
-		}
-	}
+	dt = dep_find ( mod );
 
 	if( !dt ) {
 		msg(NULL,LOG_ERR,"modprobe: module %s not found.\n", mod);
-		return;
+		kmodule_set_state ( mod, KMOD_STATE_MISSING );
+		return NULL;
 	}
 
 	// resolve alias names
 	while ( dt-> m_isalias ) {
 		if ( dt-> m_depcnt == 1 ) {
-			struct dep_t *adt;
+			struct dep_t *adt = dep_find ( dep_name ( dt, 0 ));
 
-			for ( adt = depend; adt; adt = adt-> m_next ) {
-				if ( strcmp ( adt-> m_name, dt-> m_deparr [0] ) == 0 )
-					break;
+			if ( adt && !adt-> m_isalias &&
+			     dep_blacklisted ( adt-> m_name, adt-> m_relpath )) {
+				msg(NULL,LOG_INFO,"modprobe: %s is blacklisted\n", adt-> m_name);
+				return NULL;
 			}
 			if ( adt ) {
 				/* This is the module we are aliased to */
@@ -484,17 +770,87 @@ static void check_dep (const char *mod, struct mod_list_t **head, struct mod_lis
 			}
 			else {
 				msg(NULL,LOG_ERR,"modprobe: module %s not found.\n", mod);
-				return;
+				return NULL;
 			}
 		}
 		else {
 			msg(NULL,LOG_ERR,"modprobe: bad alias %s\n", dt-> m_name);
-			return;
+			return NULL;
 		}
 	}
 
+	return dt;
+}
+
+/*
+ * Returns 1 if the module must not be loaded by its aliases: it matches a
+ * "blacklist" pattern or is disabled by an "install" line. Like modprobe,
+ * a blacklisted module can still be loaded by its name.
+ */
+int modprobe_blacklisted ( const char *name )
+{
+	struct dep_t *dt;
+
+	if ( !depend_ready )
+		depend_ready = ( build_dep ( ) == 0 );
+	if ( !depend_ready )
+		return 0;
+
+	dt = dep_find ( name );
+	if ( !dt )
+		return dep_blacklisted ( name, NULL );
+
+	return dt-> m_denied || dep_blacklisted ( dt-> m_name, dt-> m_relpath );
+}
+
+static void check_dep (const char *mod, struct mod_list_t **head, struct mod_list_t **tail, int isdep );
+
+/*
+ * Adds the softdep modules of a list to the dependency list, missing ones
+ * are skipped silently.
+ */
+static void check_softdep ( struct mod_opt_t *list, struct mod_list_t **head, struct mod_list_t **tail )
+{
+	static int depth = 0;
+
+	/* softdeps may form loops */
+	if ( depth >= 8 )
+		return;
+
+	depth++;
+	for ( ; list; list = list-> m_next ) {
+		if ( dep_find ( list-> m_opt_val ))
+			check_dep ( list-> m_opt_val, head, tail, 1 );
+	}
+	depth--;
+}
+
+/*
+ * Builds the dependency list (aka stack) of a module.
+ * head: the highest module in the stack (last to insmod, first to rmmod)
+ * tail: the lowest module in the stack (first to insmod, last to rmmod)
+ */
+static void check_dep (const char *mod, struct mod_list_t **head, struct mod_list_t **tail, int isdep )
+{
+	struct mod_list_t *find;
+	struct dep_t *dt;
+	struct mod_opt_t *opt = 0;
+	char *path = 0;
+
+	dt = resolve_dep ( mod );
+	if ( !dt )
+		return;
+
+	if ( dt-> m_denied ) {
+		msg(NULL,LOG_INFO,"modprobe: loading of %s is disabled\n", dt-> m_name);
+		return;
+	}
+
+	/* "post:" softdeps go above the module, they are inserted after it */
+	check_softdep ( dt-> m_post, head, tail );
+
 	mod = dt-> m_name;
-	path = dt-> m_path;
+	path = dep_path ( dt );
 	opt = dt-> m_options;
 
 	// search for duplicates
@@ -517,11 +873,16 @@ static void check_dep (const char *mod, struct mod_list_t **head, struct mod_lis
 	}
 
 	if ( !find ) { // did not find a duplicate
-		find = (struct mod_list_t *) malloc ( sizeof(struct mod_list_t));
+		find = (struct mod_list_t *) arena_alloc ( &dep_arena, sizeof(struct mod_list_t));
+		if ( !find )
+			return;
 		find-> m_name = (char *) mod;
 		find-> m_path = path;
 		find-> m_options = opt;
+		find-> m_isdep = isdep;
 	}
+	else if ( !isdep )
+		find-> m_isdep = 0;
 
 	// enqueue at tail
 	if ( *tail )
@@ -538,7 +899,10 @@ static void check_dep (const char *mod, struct mod_list_t **head, struct mod_lis
 
 		/* Add all dependable module for that new module */
 		for ( i = 0; i < dt-> m_depcnt; i++ )
-			check_dep ( dt-> m_deparr [i], head, tail );
+			check_dep ( dep_name ( dt, i ), head, tail, 1 );
+
+		/* "pre:" softdeps are inserted before the module */
+		check_softdep ( dt-> m_pre, head, tail );
 	}
 }
 
@@ -549,7 +913,7 @@ static int mod_insert (const char *mod )
 	int rc;
 
 	// get dep list for module mod
-	check_dep ( mod, &head, &tail );
+	check_dep ( mod, &head, &tail, 0 );
 
 	if ( head && tail ) {
 		// process tail ---> head
@@ -564,13 +928,13 @@ static int mod_insert (const char *mod )
 static int mod_remove (const char *mod )
 {
 	int rc;
-	static struct mod_list_t rm_a_dummy = { (char *) "-a", NULL, NULL, NULL, NULL };
+	static struct mod_list_t rm_a_dummy = { (char *) "-a", NULL, NULL, 0, NULL, NULL };
 
 	struct mod_list_t *head = 0;
 	struct mod_list_t *tail = 0;
 
 	if ( mod )
-		check_dep ( mod, &head, &tail );
+		check_dep ( mod, &head, &tail, 0 );
 	else  // autoclean
 		head = tail = &rm_a_dummy;
 
@@ -586,10 +950,10 @@ int modprobe_cmd(const char *name)
 {
 	int rc = EXIT_SUCCESS;
 
-	if ( !depend )
-		depend = build_dep ( );
+	if ( !depend_ready )
+		depend_ready = ( build_dep ( ) == 0 );
 
-	if ( !depend ) {
+	if ( !depend_ready ) {
 		msg(NULL,LOG_INFO, "modprobe: could not parse modules.dep\n" );
 		return (1);
 	}
@@ -605,11 +969,366 @@ int modprobe_cmd(const char *name)
 		}
 	}
 
-	/* Here would be a good place to free up memory allocated during the dependencies build. */
-
 	return rc;
 }
 
+/*
+ * Frees the dependency rules, the configuration and all module lists at
+ * once. A later modprobe builds them again.
+ */
+void modprobe_release ( init_t *init )
+{
+	struct dep_map_t *dm;
+	size_t total;
+
+	for ( dm = dep_maps; dm; dm = dm-> m_next )
+		munmap ( dm-> m_addr, dm-> m_len );
+	dep_maps = NULL;
+
+	bin_index_close ( dep_bin );
+	dep_bin = NULL;
+
+	memset ( dep_hash, 0, sizeof ( dep_hash ));
+	depend = depend_tail = NULL;
+	blacklist = NULL;
+	depend_ready = 0;
+
+	total = arena_release ( &dep_arena );
+	if ( total > 0 )
+		msg(init,LOG_INFO,"modprobe: released %zu kB of module dependency data\n",
+		    total / 1024 );
+}
+
+/*
+ * Parallel module loading
+ *
+ * modprobe_batch() builds the dependency graph of a set of modules and
+ * inserts them with a small pool of worker threads. A module is handed to
+ * a worker only after all of its dependencies are live, so independent
+ * probe routines (USB host controllers, storage, GPU) run concurrently.
+ */
+
+#define MODPROBE_MAX_WORKERS	4
+
+struct mod_node_t {	/* one module of a batch */
+	struct dep_t *  m_dep;
+	int             m_waiting;		/* dependencies not yet inserted */
+	int             m_done;
+	int             m_rc;
+	int             m_explicit;		/* requested, not only a dependency */
+
+	int             m_usercnt;		/* modules depending on this one */
+	struct mod_node_t ** m_users;
+
+	struct mod_node_t * m_ready;		/* next module in ready queue */
+};
+
+struct mod_batch_t {
+	struct mod_node_t ** m_nodes;
+	int                  m_count;
+	int                  m_max;
+	int                  m_pending;		/* modules not yet inserted */
+	int                  m_running;		/* modules inserted right now */
+	int                  m_failed;
+	struct mod_node_t *  m_ready;
+	const char *         m_origin;		/* module trace origin of the caller */
+
+	pthread_mutex_t      m_lock;
+	pthread_cond_t       m_cond;
+};
+
+static struct mod_node_t *batch_node ( struct mod_batch_t *batch, struct dep_t *dt )
+{
+	int i;
+
+	for ( i = 0; i < batch-> m_count; i++ ) {
+		if ( batch-> m_nodes [i]-> m_dep == dt )
+			return batch-> m_nodes [i];
+	}
+	return NULL;
+}
+
+/*
+ * Lets user wait for node, returns 0 on success.
+ */
+static int batch_link ( struct mod_node_t *node, struct mod_node_t *user )
+{
+	struct mod_node_t **users;
+
+	users = realloc ( node-> m_users,
+			sizeof ( struct mod_node_t * ) * ( node-> m_usercnt + 1 ));
+	if ( !users )
+		return -1;
+	node-> m_users = users;
+	node-> m_users [node-> m_usercnt++] = user;
+	user-> m_waiting++;
+	return 0;
+}
+
+static struct mod_node_t *batch_add ( struct mod_batch_t *batch, struct dep_t *dt );
+
+/*
+ * Adds the softdep modules of a list to the batch, missing ones are
+ * skipped silently. "pre:" modules are inserted before node, "post:"
+ * modules after it.
+ */
+static void batch_add_softdep ( struct mod_batch_t *batch, struct mod_node_t *node,
+				struct mod_opt_t *list, int post )
+{
+	struct mod_node_t *snode;
+	struct dep_t *sdt;
+
+	for ( ; list; list = list-> m_next ) {
+		if ( !dep_find ( list-> m_opt_val ))
+			continue;
+		sdt = resolve_dep ( list-> m_opt_val );
+		if ( !sdt || sdt == node-> m_dep )
+			continue;
+		snode = batch_add ( batch, sdt );
+		if ( !snode || snode-> m_done )
+			continue;
+		if ( post )
+			batch_link ( node, snode );
+		else
+			batch_link ( snode, node );
+	}
+}
+
+/*
+ * Adds a resolved module and (recursively) all of its dependencies to the
+ * batch, returns the node of the module or NULL on errors.
+ */
+static struct mod_node_t *batch_add ( struct mod_batch_t *batch, struct dep_t *dt )
+{
+	struct mod_node_t *node, *dnode, **nodes;
+	struct dep_t *ddt;
+	int i;
+
+	if (( node = batch_node ( batch, dt )))
+		return node;
+
+	if ( batch-> m_count == batch-> m_max ) {
+		/* nodes are referenced by pointer, only the array is grown */
+		nodes = realloc ( batch-> m_nodes,
+				sizeof ( struct mod_node_t * ) * ( batch-> m_max + 32 ));
+		if ( !nodes )
+			return NULL;
+		batch-> m_nodes = nodes;
+		batch-> m_max += 32;
+	}
+
+	node = (struct mod_node_t *) calloc ( 1, sizeof ( struct mod_node_t ));
+	if ( !node )
+		return NULL;
+	batch-> m_nodes [batch-> m_count++] = node;
+	node-> m_dep = dt;
+
+	if ( kmodule_already_loaded ( NULL, dt-> m_name ) == 1 ) {
+		node-> m_done = 1;
+		return node;
+	}
+
+	if ( dt-> m_denied ) {
+		msg(NULL,LOG_INFO,"modprobe: loading of %s is disabled\n", dt-> m_name);
+		node-> m_done = 1;
+		return node;
+	}
+
+	for ( i = 0; i < dt-> m_depcnt; i++ ) {
+		ddt = resolve_dep ( dep_name ( dt, i ));
+		if ( !ddt || ddt == dt )
+			continue;
+		dnode = batch_add ( batch, ddt );
+		if ( !dnode || dnode-> m_done )
+			continue;
+		batch_link ( dnode, node );
+	}
+
+	batch_add_softdep ( batch, node, dt-> m_pre, 0 );
+	batch_add_softdep ( batch, node, dt-> m_post, 1 );
+
+	/* build the path here, workers only read the rules */
+	dep_path ( dt );
+
+	batch-> m_pending++;
+	return node;
+}
+
+/*
+ * Starts reading the module files of a batch, so the workers do not wait
+ * for the disk one module after the other.
+ */
+static void batch_readahead ( struct mod_batch_t *batch )
+{
+	int i, fd;
+
+	for ( i = 0; i < batch-> m_count; i++ ) {
+		if ( batch-> m_nodes [i]-> m_done || !batch-> m_nodes [i]-> m_dep-> m_path )
+			continue;
+		fd = open ( batch-> m_nodes [i]-> m_dep-> m_path, O_RDONLY | O_CLOEXEC );
+		if ( fd < 0 )
+			continue;
+		posix_fadvise ( fd, 0, 0, POSIX_FADV_WILLNEED );
+		close ( fd );
+	}
+}
+
+static void *batch_worker ( void *arg )
+{
+	struct mod_batch_t *batch = arg;
+	struct mod_node_t *node;
+	const char *origin;
+	int i, rc;
+
+	origin = modtrace_push ( batch-> m_origin );
+
+	pthread_mutex_lock ( &batch-> m_lock );
+	while ( batch-> m_pending > 0 ) {
+		node = batch-> m_ready;
+		if ( !node ) {
+			/* nothing ready and nothing running: a dependency loop */
+			if ( batch-> m_running == 0 )
+				break;
+			pthread_cond_wait ( &batch-> m_cond, &batch-> m_lock );
+			continue;
+		}
+		batch-> m_ready = node-> m_ready;
+		batch-> m_running++;
+		pthread_mutex_unlock ( &batch-> m_lock );
+
+		modtrace_dependency ( !node-> m_explicit );
+		rc = insmod_cmd ( node-> m_dep-> m_path, node-> m_dep-> m_options );
+		modtrace_dependency ( 0 );
+
+		pthread_mutex_lock ( &batch-> m_lock );
+		node-> m_rc = rc;
+		node-> m_done = 1;
+		if ( rc != 0 )
+			batch-> m_failed++;
+		batch-> m_running--;
+		batch-> m_pending--;
+
+		/* like the sequential loader, modules depending on a failed
+		   one are still tried */
+		for ( i = 0; i < node-> m_usercnt; i++ ) {
+			if ( --node-> m_users [i]-> m_waiting == 0 ) {
+				node-> m_users [i]-> m_ready = batch-> m_ready;
+				batch-> m_ready = node-> m_users [i];
+			}
+		}
+		pthread_cond_broadcast ( &batch-> m_cond );
+	}
+	pthread_cond_broadcast ( &batch-> m_cond );
+	pthread_mutex_unlock ( &batch-> m_lock );
+
+	modtrace_pop ( origin );
+
+	return NULL;
+}
+
+/*
+ * Loads a batch of modules (and their dependencies) in parallel.
+ * Returns the number of modules which failed to load.
+ */
+int modprobe_batch ( init_t *init, const char **names, int count )
+{
+	struct mod_batch_t batch;
+	struct timespec start, end;
+	pthread_t workers [MODPROBE_MAX_WORKERS];
+	struct mod_node_t *node;
+	struct dep_t *dt;
+	int i, n, nworkers, unresolved = 0;
+
+	if ( count <= 0 )
+		return 0;
+
+	if ( !depend_ready )
+		depend_ready = ( build_dep ( ) == 0 );
+
+	if ( !depend_ready ) {
+		msg(NULL,LOG_INFO, "modprobe: could not parse modules.dep\n" );
+		return count;
+	}
+
+	clock_gettime ( CLOCK_MONOTONIC, &start );
+
+	memset ( &batch, 0, sizeof ( batch ));
+	batch. m_origin = modtrace_origin ( );
+
+	for ( i = 0; i < count; i++ ) {
+		if ( kmodule_already_loaded ( init, names [i] ) == 1 )
+			continue;
+		dt = resolve_dep ( names [i] );
+		if ( !dt ) {
+			unresolved++;
+			continue;
+		}
+		msg(init,LOG_INFO,"Loading %s module\n", names [i]);
+		node = batch_add ( &batch, dt );
+		if ( node )
+			node-> m_explicit = 1;
+	}
+
+	n = batch. m_pending;
+	if ( n > 0 ) {
+		/* "post:" softdeps link modules after they were added, so the
+		   ready queue is filled once the graph is complete */
+		for ( i = 0; i < batch. m_count; i++ ) {
+			if ( batch. m_nodes [i]-> m_done || batch. m_nodes [i]-> m_waiting > 0 )
+				continue;
+			batch. m_nodes [i]-> m_ready = batch. m_ready;
+			batch. m_ready = batch. m_nodes [i];
+		}
+
+		batch_readahead ( &batch );
+
+		/* probe routines mostly wait for hardware, so the pool is not
+		   limited to the number of CPUs */
+		nworkers = MODPROBE_MAX_WORKERS;
+		if ( n < nworkers )
+			nworkers = n;
+
+		pthread_mutex_init ( &batch. m_lock, NULL );
+		pthread_cond_init ( &batch. m_cond, NULL );
+
+		for ( i = 0; i < nworkers; i++ ) {
+			if ( pthread_create ( &workers [i], NULL, batch_worker, &batch ) != 0 )
+				break;
+		}
+		nworkers = i;
+
+		/* no thread could be started, insert from this thread */
+		if ( nworkers == 0 )
+			batch_worker ( &batch );
+
+		for ( i = 0; i < nworkers; i++ )
+			pthread_join ( workers [i], NULL );
+
+		pthread_cond_destroy ( &batch. m_cond );
+		pthread_mutex_destroy ( &batch. m_lock );
+
+		if ( batch. m_pending > 0 ) {
+			msg(init,LOG_ERR,"modprobe: %d modules not loaded (dependency loop)\n",
+			    batch. m_pending );
+			batch. m_failed += batch. m_pending;
+		}
+	}
+
+	clock_gettime ( CLOCK_MONOTONIC, &end );
+	msg(init,LOG_INFO,"modprobe: inserted %d of %d modules in %ld ms\n",
+	    n - batch. m_failed, n,
+	    ( end. tv_sec - start. tv_sec ) * 1000 +
+	    ( end. tv_nsec - start. tv_nsec ) / 1000000 );
+
+	for ( i = 0; i < batch. m_count; i++ ) {
+		free ( batch. m_nodes [i]-> m_users );
+		free ( batch. m_nodes [i] );
+	}
+	free ( batch. m_nodes );
+
+	return batch. m_failed + unresolved;
+}
+
 int modprobe(int argc, char **argv)
 {
 	int i;
@@ -0,0 +1,223 @@
+/*
+ * initramfs init program.
+ * trace how long every kernel module takes to load.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "init.h"
+
+/* Every insmod and every explicit module request is appended as one JSON
+ * line to MODTRACE_FILE, which survives the switch to the real root with
+ * /dev:
+ *
+ *   {"type":"insmod","module":"xhci_hcd","origin":"alias","dep":0,
+ *    "start_us":812345,"dur_us":10234,"rc":0,"tid":123}
+ *
+ * start_us is CLOCK_MONOTONIC (time since boot). The origin tells what
+ * asked for the module: "plan", "alias", "uevent" or "explicit"; dep is 1
+ * if it was only loaded as dependency of another module. */
+
+#define MODTRACE_FILE		"/dev/.initramfs.modtrace"
+#define MODTRACE_SUMMARY	20	/* slowest modules in the summary */
+
+struct modtrace_rec {
+	char		module[64];
+	const char	*origin;
+	int		dep;
+	long		start_us;
+	long		dur_us;
+	int		rc;
+};
+
+static struct modtrace_rec *trace_recs = NULL;
+static int trace_count = 0;
+static int trace_max = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* what the current thread is loading modules for */
+static __thread const char *trace_origin = NULL;
+static __thread int trace_dep = 0;
+
+long
+modtrace_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* set the origin of the following module loads of this thread, unless an
+ * outer caller already did. Returns the value to pass to modtrace_pop(). */
+
+const char *
+modtrace_push (const char *origin)
+{
+	const char *prev = trace_origin;
+
+	if (trace_origin == NULL)
+		trace_origin = origin;
+	return prev;
+}
+
+void
+modtrace_pop (const char *prev)
+{
+	trace_origin = prev;
+}
+
+const char *
+modtrace_origin (void)
+{
+	return trace_origin;
+}
+
+/* mark the following insmods of this thread as dependency loads */
+
+void
+modtrace_dependency (int dep)
+{
+	trace_dep = dep;
+}
+
+static void modtrace_write (const char *type, const struct modtrace_rec *r)
+{
+	char line[256];
+	int fd, len;
+
+	len = snprintf(line, sizeof(line),
+		       "{\"type\":\"%s\",\"module\":\"%s\",\"origin\":\"%s\",\"dep\":%d,"
+		       "\"start_us\":%ld,\"dur_us\":%ld,\"rc\":%d,\"tid\":%ld}\n",
+		       type, r->module, r->origin, r->dep, r->start_us, r->dur_us,
+		       r->rc, (long) syscall(SYS_gettid));
+	if (len <= 0 || len >= (int) sizeof(line))
+		return;
+
+	/* one write per line, lines of parallel loads do not mix */
+	fd = open(MODTRACE_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	iwrite(fd, (unsigned char *) line, len);
+	close(fd);
+}
+
+static void modtrace_fill (struct modtrace_rec *r, const char *name, long start_us, int rc)
+{
+	const char *base = strrchr(name, '/');
+	size_t i;
+
+	base = base ? base + 1 : name;
+
+	/* module name without extension, safe to print as JSON string */
+	for (i = 0; base[i] && base[i] != '.' && i < sizeof(r->module) - 1; i++)
+		r->module[i] = (base[i] == '"' || base[i] == '\\' ||
+				(unsigned char) base[i] < ' ') ? '_' : base[i];
+	r->module[i] = '\0';
+
+	r->origin = trace_origin ? trace_origin : "explicit";
+	r->dep = trace_dep;
+	r->start_us = start_us;
+	r->dur_us = modtrace_now() - start_us;
+	r->rc = rc;
+}
+
+/* record one insmod which started at start_us */
+
+void
+modtrace_insmod (const char *filename, long start_us, int rc)
+{
+	struct modtrace_rec r, *n;
+
+	modtrace_fill(&r, filename, start_us, rc);
+	modtrace_write("insmod", &r);
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_count == trace_max) {
+		n = realloc(trace_recs, (trace_max + 64) * sizeof(struct modtrace_rec));
+		if (n == NULL)
+			goto out;
+		trace_recs = n;
+		trace_max += 64;
+	}
+	trace_recs[trace_count++] = r;
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* record an explicit module request, including its dependencies */
+
+void
+modtrace_request (const char *name, long start_us, int rc)
+{
+	struct modtrace_rec r;
+
+	modtrace_fill(&r, name, start_us, rc);
+	modtrace_write("request", &r);
+}
+
+static int cmp_duration (const void *a, const void *b)
+{
+	const struct modtrace_rec *ra = a, *rb = b;
+
+	if (ra->dur_us != rb->dur_us)
+		return ra->dur_us < rb->dur_us ? 1 : -1;
+	return strcmp(ra->module, rb->module);
+}
+
+/* log the modules which took the most time to load */
+
+void
+modtrace_summary (init_t *init)
+{
+	struct modtrace_rec *sorted;
+	long total = 0;
+	int i, count;
+
+	pthread_mutex_lock(&trace_lock);
+	count = trace_count;
+	sorted = malloc(count * sizeof(struct modtrace_rec));
+	if (sorted != NULL)
+		memcpy(sorted, trace_recs, count * sizeof(struct modtrace_rec));
+	pthread_mutex_unlock(&trace_lock);
+
+	if (sorted == NULL || count == 0) {
+		free(sorted);
+		return;
+	}
+
+	qsort(sorted, count, sizeof(struct modtrace_rec), cmp_duration);
+	for (i = 0; i < count; i++)
+		total += sorted[i].dur_us;
+
+	msg(init,LOG_INFO,"modtrace: %d modules inserted, %ld ms in insmod (see %s)\n",
+	    count, total / 1000, MODTRACE_FILE);
+	for (i = 0; i < count && i < MODTRACE_SUMMARY; i++)
+		msg(init,LOG_INFO,"modtrace: %6ld ms  %-24s %s%s%s\n",
+		    sorted[i].dur_us / 1000, sorted[i].module, sorted[i].origin,
+		    sorted[i].dep ? " (dependency)" : "",
+		    sorted[i].rc != 0 ? " failed" : "");
+
+	free(sorted);
+}
@@ -0,0 +1,345 @@
+/*
+ * initramfs init program.
+ * read GPT and MBR partition tables directly from the disk.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <igel64/igel.h>
+#include "init.h"
+
+/* The partitions are numbered the way the kernel does it: GPT partitions
+ * by their slot in the entry array, MBR primary partitions 1-4 and the
+ * logical partitions of the extended partition from 5 on. Offsets and
+ * sizes are stored in bytes. */
+
+#define GPT_SIGNATURE		"EFI PART"
+#define GPT_MAX_ENTRIES_SIZE	(1024 * 1024)
+
+/* covers the MBR, the GPT header and 128 entries directly behind it */
+#define PT_HEAD_SIZE(sector)	(2 * (sector) + 128 * 128)
+
+#define MBR_TYPE_GPT		0xee
+
+static inline uint32_t get_le32 (const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t get_le64 (const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static int pt_read (int fd, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t n;
+
+	do {
+		n = pread(fd, buf, len, (off_t) offset);
+	} while (n < 0 && errno == EINTR);
+
+	return (n == (ssize_t) len) ? 0 : -1;
+}
+
+static void pt_set (struct disk_parts *dp, int part, uint64_t start, uint64_t size)
+{
+	if (part < 1 || part > MAX_PART_NUM)
+		return;
+	dp->start[part - 1] = start;
+	dp->size[part - 1] = size;
+}
+
+/* check the GPT header at lba and read its entries, returns 0 if the
+ * header and the entries are valid */
+
+static int gpt_read (struct disk_parts *dp, int fd, unsigned char *head, size_t head_len,
+		     uint64_t lba, unsigned int sector)
+{
+	unsigned char *hdr, *entries, *e, *buf = NULL, *hbuf = NULL;
+	uint32_t hdr_size, hdr_crc, count, esize;
+	uint64_t entries_lba, first, last, total;
+	unsigned int i;
+	int ret = -1;
+
+	if ((lba + 1) * sector <= head_len) {
+		hdr = head + lba * sector;
+	} else {
+		hbuf = malloc(sector);
+		if (hbuf == NULL || pt_read(fd, hbuf, sector, lba * sector) != 0)
+			goto out;
+		hdr = hbuf;
+	}
+
+	if (memcmp(hdr, GPT_SIGNATURE, 8) != 0)
+		goto out;
+	hdr_size = get_le32(hdr + 12);
+	if (hdr_size < 92 || hdr_size > sector)
+		goto out;
+	hdr_crc = get_le32(hdr + 16);
+	memset(hdr + 16, 0, 4);
+	if (crc32(0, hdr, hdr_size) != hdr_crc)
+		goto out;
+	if (get_le64(hdr + 24) != lba)
+		goto out;
+
+	entries_lba = get_le64(hdr + 72);
+	count = get_le32(hdr + 80);
+	esize = get_le32(hdr + 84);
+	if (esize < 128 || (esize & (esize - 1)) != 0 || count == 0 ||
+	    (uint64_t) count * esize > GPT_MAX_ENTRIES_SIZE)
+		goto out;
+	total = (uint64_t) count * esize;
+
+	if (entries_lba * sector + total <= head_len) {
+		entries = head + entries_lba * sector;
+	} else {
+		buf = malloc(total);
+		if (buf == NULL || pt_read(fd, buf, total, entries_lba * sector) != 0)
+			goto out;
+		entries = buf;
+	}
+	if (crc32(0, entries, total) != get_le32(hdr + 88))
+		goto out;
+
+	for (i = 0; i < count && i < MAX_PART_NUM; i++) {
+		e = entries + (size_t) i * esize;
+		/* unused entries have a zero type guid */
+		if (get_le64(e) == 0 && get_le64(e + 8) == 0)
+			continue;
+		first = get_le64(e + 32);
+		last = get_le64(e + 40);
+		if (last < first || (last + 1) * sector > dp->devsize)
+			continue;
+		pt_set(dp, i + 1, first * sector, (last - first + 1) * sector);
+	}
+	ret = 0;
+out:
+	free(hbuf);
+	free(buf);
+	return ret;
+}
+
+static int mbr_is_extended (unsigned char type)
+{
+	return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+/* walk the chain of extended boot records, the logical partitions are
+ * numbered from 5 on */
+
+static void ebr_read (struct disk_parts *dp, int fd, uint64_t ext_start, uint64_t ext_size,
+		      unsigned int sector)
+{
+	unsigned char *ebr, *p;
+	uint64_t cur = ext_start, start, size;
+	int part = 5, loops;
+
+	ebr = malloc(sector);
+	if (ebr == NULL)
+		return;
+
+	for (loops = 0; loops < MAX_PART_NUM && part <= MAX_PART_NUM; loops++) {
+		if (pt_read(fd, ebr, sector, cur * sector) != 0)
+			break;
+		if (ebr[510] != 0x55 || ebr[511] != 0xaa)
+			break;
+
+		/* 1st entry: the logical partition relative to this EBR */
+		p = ebr + 446;
+		start = get_le32(p + 8);
+		size = get_le32(p + 12);
+		if (p[4] != 0 && size != 0 && !mbr_is_extended(p[4]) &&
+		    cur + start + size <= ext_start + ext_size)
+			pt_set(dp, part++, (cur + start) * sector, size * sector);
+
+		/* 2nd entry: the next EBR relative to the extended partition */
+		p = ebr + 446 + 16;
+		start = get_le32(p + 8);
+		if (!mbr_is_extended(p[4]) || start == 0 || start >= ext_size)
+			break;
+		cur = ext_start + start;
+	}
+
+	free(ebr);
+}
+
+static int mbr_read (struct disk_parts *dp, int fd, const unsigned char *mbr, unsigned int sector)
+{
+	const unsigned char *p;
+	uint64_t start, size;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p = mbr + 446 + i * 16;
+		if (p[0] != 0 && p[0] != 0x80)
+			return -1;	/* not a partition table, maybe a boot sector */
+	}
+
+	for (i = 0; i < 4; i++) {
+		p = mbr + 446 + i * 16;
+		start = get_le32(p + 8);
+		size = get_le32(p + 12);
+		if (p[4] == 0 || size == 0)
+			continue;
+		if (mbr_is_extended(p[4])) {
+			/* like the kernel: the extended partition itself only
+			   covers its first bytes */
+			pt_set(dp, i + 1, start * sector,
+			       size * sector < 1024 ? size * sector :
+			       (sector > 1024 ? sector : 1024));
+			ebr_read(dp, fd, start, size, sector);
+		} else {
+			pt_set(dp, i + 1, start * sector, size * sector);
+		}
+	}
+
+	return 0;
+}
+
+/* fill dp from the partition table on the disk devname (entry of
+ * /sys/block). Returns 0 on success, -1 if the disk can
+ * not be read or has no GPT or MBR partition table. */
+
+int
+read_partition_table (const char *devname, struct disk_parts *dp)
+{
+	char name[64];
+	unsigned char *head = NULL;
+	unsigned int sector;
+	uint64_t devsize;
+	int ssz;
+	size_t head_len;
+	int fd, i, gpt = 0, ret = -1;
+
+	snprintf(name, sizeof(name), "/dev/%s", devname);
+	name[sizeof(name)-1] = '\0';
+
+	fd = open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (ioctl(fd, BLKSSZGET, &ssz) != 0 || ssz < 512 || ssz > 65536 ||
+	    (ssz & (ssz - 1)) != 0)
+		goto out;
+	sector = ssz;
+	if (ioctl(fd, BLKGETSIZE64, &devsize) != 0 || devsize < 2 * sector)
+		goto out;
+
+	head_len = PT_HEAD_SIZE(sector);
+	if (head_len > devsize)
+		head_len = 2 * sector;
+	head = malloc(head_len);
+	if (head == NULL || pt_read(fd, head, head_len, 0) != 0)
+		goto out;
+	if (head[510] != 0x55 || head[511] != 0xaa)
+		goto out;
+
+	memset(dp, 0, sizeof(struct disk_parts));
+	dp->devsize = devsize;
+
+	for (i = 0; i < 4; i++) {
+		if (head[446 + i * 16 + 4] == MBR_TYPE_GPT)
+			gpt = 1;
+	}
+
+	if (gpt) {
+		/* primary header, else the backup in the last sector */
+		if (gpt_read(dp, fd, head, head_len, 1, sector) == 0 ||
+		    gpt_read(dp, fd, head, head_len, devsize / sector - 1, sector) == 0)
+			ret = 0;
+	} else {
+		ret = mbr_read(dp, fd, head, sector);
+	}
+
+	if (ret != 0) {
+		memset(dp->start, 0, MAX_PART_NUM * sizeof(uint64_t));
+		memset(dp->size, 0, MAX_PART_NUM * sizeof(uint64_t));
+	}
+out:
+	free(head);
+	close(fd);
+	return ret;
+}
+
+/* Check the partitions of dp for the IGEL boot registry ident and the
+ * "PDIR" partition directory magic, the same test check_if_igel_part()
+ * does. Partitions which can not be read are kept as candidates. */
+
+void
+read_igel_signatures (const char *devname, struct disk_parts *dp)
+{
+	char name[64], ident[17], dir_ident[4];
+	int fd, i;
+
+	snprintf(name, sizeof(name), "/dev/%s", devname);
+	name[sizeof(name)-1] = '\0';
+
+	fd = open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < MAX_PART_NUM; i++) {
+		if (dp->size[i] == 0)
+			continue;
+		if (dp->size[i] < DIR_OFFSET + sizeof(dir_ident)) {
+			dp->igel[i] = 0;
+			continue;
+		}
+		if (pt_read(fd, ident, sizeof(ident), dp->start[i] + IGEL_BOOTREG_OFFSET) != 0 ||
+		    pt_read(fd, dir_ident, sizeof(dir_ident), dp->start[i] + DIR_OFFSET) != 0) {
+			dp->igel[i] = 1;
+			continue;
+		}
+		dp->igel[i] = (memcmp(ident, BOOTREG_IDENT, sizeof(ident)) == 0 &&
+			       memcmp(dir_ident, "PDIR", sizeof(dir_ident)) == 0);
+	}
+	dp->have_igel = 1;
+
+	close(fd);
+}
+
+/* returns 1 if partition part of the disk devname carries the IGEL
+ * signatures (or can not be read, like read_igel_signatures()) */
+
+int
+igel_partition (const char *devname, int part)
+{
+	struct disk_parts dp;
+
+	if (part < 1 || part > MAX_PART_NUM || read_partition_table(devname, &dp) != 0)
+		return 0;
+	read_igel_signatures(devname, &dp);
+
+	return (dp.size[part - 1] != 0 && dp.igel[part - 1]);
+}
@@ -103,5 +103,6 @@ int rmmod_cmd(const char *name)
 		return(EXIT_FAILURE);
 	}
 
+	kmodule_set_state(module_name, KMOD_STATE_UNLOADED);
 	return(EXIT_SUCCESS);
 }
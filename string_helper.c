@@ -116,3 +116,43 @@ void remove_end_newline(char *s1)
 	if (s1 && *p == '\n')
 		*p = '\0';
 }
+
+/* FNV-1a hash over the first len bytes of s */
+unsigned int hash_string(const char *s, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/* kernel module file extensions, compressed ones are loaded through
+ * finit_module() or decompressed by insmod_cmd() */
+static const char *module_exts[] = {
+	".ko",
+	".ko.gz",
+	".ko.xz",
+	".ko.zst",
+	NULL
+};
+
+/* return the length of the module extension the first len bytes of name
+ * end with, 0 if name does not end with a module extension */
+
+int module_ext_len(const char *name, size_t len)
+{
+	size_t l;
+	int i;
+
+	for (i = 0; module_exts[i] != NULL; i++) {
+		l = strlen(module_exts[i]);
+		if (len >= l && strncmp(name + len - l, module_exts[i], l) == 0)
+			return (int) l;
+	}
+
+	return 0;
+}
@@ -22,6 +22,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <libsysfs.h>
 #include "init.h"
 
@@ -86,155 +92,255 @@ static char* get_attribute_value(struct sysfs_attribute *attr)
 
 int find_pci_vendors (struct vendor_list *vendors)
 {
-	struct sysfs_bus   *bus    = NULL;
-	struct dlist       *list   = NULL;
 	struct vendor_list *vendor = NULL;
+	unsigned long id;
+	char *end;
+
+	for (vendor = vendors; vendor != NULL; vendor = vendor->next) {
+		id = strtoul(vendor->name, &end, 16);
+		if (end == vendor->name || *end != '\0' || id > 0xffff)
+			continue;
+		if (hwinv_has_pci_vendor(id))
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Cache of open directories below /sys/class, the attributes are read with
+ * openat() instead of letting libsysfs read the whole class for every
+ * value. A cached directory is reopened if its device went away and came
+ * back with the same name.
+ */
+
+#define CLASS_DIR_CACHE		8
+#define CLASS_ATTR_MAX		4096	/* sysfs values are at most a page */
 
-	if (vendors == NULL)
-		return (0);
+struct class_dir {
+	char	path[64];	/* "<class>/<device>" below /sys/class */
+	int	fd;
+	dev_t	dev;
+	ino_t	ino;
+};
+
+static struct class_dir class_dirs[CLASS_DIR_CACHE];
+static int class_dir_next = 0;
+static pthread_mutex_t class_dir_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	bus = sysfs_open_bus("pci");
-	if (bus == NULL) {
-		return (0);
+static int class_dir_open(struct class_dir *d)
+{
+	char path[SYSFS_PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/sys/class/%s", d->path);
+	d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d->fd < 0)
+		return -1;
+	if (fstat(d->fd, &st) != 0) {
+		close(d->fd);
+		d->fd = -1;
+		return -1;
 	}
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
 
-	list = sysfs_get_bus_devices(bus);
-	if (list) {
-		struct sysfs_device    *dev  = NULL;
-		struct sysfs_attribute *attr = NULL;
-		dlist_for_each_data(list, dev, struct sysfs_device) {
-			attr = sysfs_get_device_attr(dev, "vendor");
-			if (attr) {
-				vendor = vendors;
-				do {
-					if (match_string_nocase(attr->value, vendor->name) == 0) {
-						sysfs_close_bus(bus);
-						return (1);
-					}
-				} while ((vendor = vendor->next) != NULL);
-			}
-		}
+	return d->fd;
+}
+
+/* returns 1 if the directory was removed or replaced since it was opened */
+
+static int class_dir_stale(struct class_dir *d)
+{
+	char path[SYSFS_PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/sys/class/%s", d->path);
+	if (stat(path, &st) != 0)
+		return 1;
+	return (st.st_dev != d->dev || st.st_ino != d->ino);
+}
+
+/* the cache entry of /sys/class/<cls>/<dev>, NULL if there is no such
+ * directory. Called with class_dir_lock held. */
+
+static struct class_dir *class_dir_get(const char *cls, const char *dev)
+{
+	char path[sizeof(class_dirs[0].path)];
+	struct class_dir *d;
+	int i, len;
+
+	len = snprintf(path, sizeof(path), "%s/%s", cls, dev);
+	if (len < 0 || len >= (int) sizeof(path) || strstr(dev, "..") != NULL)
+		return NULL;
+
+	for (i = 0; i < CLASS_DIR_CACHE; i++) {
+		d = &class_dirs[i];
+		if (d->path[0] != '\0' && strcmp(d->path, path) == 0)
+			return d;
 	}
-	sysfs_close_bus(bus);
 
-	return (0);
+	d = &class_dirs[class_dir_next];
+	class_dir_next = (class_dir_next + 1) % CLASS_DIR_CACHE;
+	if (d->path[0] != '\0' && d->fd >= 0)
+		close(d->fd);
+	strcpy(d->path, path);
+	if (class_dir_open(d) < 0) {
+		d->path[0] = '\0';
+		return NULL;
+	}
+
+	return d;
 }
 
 /*
- * get sysfs dmi entries
- *
- * returns value of entry or NULL if not found
+ * read the attribute name relative to dirfd into val, without the newline
+ * at the end. Returns NULL for missing, empty and binary attributes.
  */
 
-char *get_dmi_data(const char *field, char *buffer, size_t len_buf)
+static char *attr_read_at(int dirfd, const char *name, char *val, size_t len_val)
 {
-	char                      *buf = NULL;
-	struct sysfs_class        *cls = NULL;
-	struct sysfs_class_device *clsdev = NULL;
-	struct sysfs_device       *dev = NULL;
-	struct sysfs_attribute    *attr = NULL;
-	char                      *p = NULL;
-
-	cls = sysfs_open_class("dmi");
-	if (cls == NULL)
+	const char *base, **b;
+	ssize_t n;
+	int fd;
+
+	base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	for (b = binary_files; *b != NULL; b++) {
+		if (strcmp(base, *b) == 0)
+			return NULL;
+	}
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	do {
+		n = read(fd, val, len_val - 1);
+	} while (n < 0 && errno == EINTR);
+	close(fd);
+	if (n <= 0)
+		return NULL;
+
+	val[n] = '\0';
+	remove_end_newline(val);
+	if (val[0] == '\0')
 		return NULL;
 
-	clsdev = sysfs_get_class_device(cls, "id");
-	if (clsdev) {
-		dev = sysfs_get_classdev_device(clsdev);
-		if (dev) {
-			attr = sysfs_get_device_attr(dev, field);
-			if (attr) {
-				p = get_attribute_value(attr);
+	return val;
+}
+
+/*
+ * read the attribute name of /sys/class/<cls>/<dev>, and if fallback is
+ * set and the class device has no such attribute, of its device and the
+ * parents of the device, then of the queue directory (block devices).
+ */
+
+static char *class_attr_read(const char *cls, const char *dev, const char *name,
+			     int fallback, char *val, size_t len_val)
+{
+	char path[SYSFS_PATH_MAX];
+	struct class_dir *d;
+	struct stat st, top;
+	char *p = NULL;
+	int fd, parent, retry;
+
+	pthread_mutex_lock(&class_dir_lock);
+
+	for (retry = 0; retry < 2 && p == NULL; retry++) {
+		d = class_dir_get(cls, dev);
+		if (d == NULL)
+			break;
+
+		p = attr_read_at(d->fd, name, val, len_val);
+		if (p == NULL && fallback) {
+			/* the device and its parents up to /sys/devices */
+			if (stat("/sys/devices", &top) != 0)
+				top.st_ino = 0;
+			fd = openat(d->fd, "device", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			while (fd >= 0 && p == NULL) {
+				p = attr_read_at(fd, name, val, len_val);
+				if (p != NULL)
+					break;
+				parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				close(fd);
+				fd = parent;
+				if (fd >= 0 && fstat(fd, &st) == 0 &&
+				    st.st_dev == top.st_dev && st.st_ino == top.st_ino) {
+					close(fd);
+					fd = -1;
+				}
 			}
-		} else {
-			attr = sysfs_get_classdev_attr(clsdev, field);
-			if (attr) {
-				p = get_attribute_value(attr);
+			if (fd >= 0)
+				close(fd);
+
+			if (p == NULL) {
+				snprintf(path, sizeof(path), "queue/%s", name);
+				p = attr_read_at(d->fd, path, val, len_val);
 			}
 		}
+
+		/* the device was replaced, open it again */
+		if (p != NULL || !class_dir_stale(d))
+			break;
+		close(d->fd);
+		d->fd = -1;
+		d->path[0] = '\0';
 	}
 
-	if (p != NULL) {
-		if (buffer && len_buf > 0) {
-			memset(buffer, 0, len_buf);
-			strncpy(buffer, p, len_buf);
-			buf = buffer;
-		} else {
-			buf = strdup(p);
-		}
+	pthread_mutex_unlock(&class_dir_lock);
+	return p;
+}
+
+/*
+ * copy an attribute value into the buffer of the caller, or into a new
+ * string if there is none
+ */
+
+static char *attr_copy(const char *p, char *buffer, size_t len_buf)
+{
+	if (p == NULL)
+		return NULL;
+
+	if (buffer && len_buf > 0) {
+		memset(buffer, 0, len_buf);
+		strncpy(buffer, p, len_buf - 1);
+		return buffer;
 	}
 
-	sysfs_close_class(cls);
-	return buf;
+	return strdup(p);
 }
 
 /*
- * get sysfs block entries
+ * get sysfs dmi entries
  *
  * returns value of entry or NULL if not found
  */
 
-char *get_block_data(const char *blk_dev, const char *field, char *buffer, size_t len_buf)
+char *get_dmi_data(const char *field, char *buffer, size_t len_buf)
 {
-	char                      *buf = NULL;
-	struct sysfs_class        *cls = NULL;
-	struct sysfs_class_device *clsdev = NULL;
-	struct sysfs_device       *dev = NULL;
-	struct sysfs_attribute    *attr = NULL;
-	char                      *p = NULL;
-	char                       path[SYSFS_PATH_MAX];
-
-	cls = sysfs_open_class("block");
-	if (cls == NULL)
-		return NULL;
+	char val[CLASS_ATTR_MAX], name[SYSFS_PATH_MAX];
+	char *p;
 
-	clsdev = sysfs_get_class_device(cls, blk_dev);
-	if (clsdev != NULL) {
-		attr = sysfs_get_classdev_attr(clsdev, field);
-		if (attr) {
-			p = get_attribute_value(attr);
-		} else {
-			dev = sysfs_get_classdev_device(clsdev);
-			while (dev && p == NULL) {
-				attr = sysfs_get_device_attr(dev, field);
-				if (attr) {
-					p = get_attribute_value(attr);
-				} else {
-					dev = sysfs_get_device_parent(dev);
-				}
-			}
-		}
-		attr = NULL;
-		if (!p) {
-			memset(path, 0, SYSFS_PATH_MAX);
-			strncpy(path, clsdev->path, SYSFS_PATH_MAX);
-			strncat(path, "/queue/", SYSFS_PATH_MAX - 1);
-			strncat(path, field, SYSFS_PATH_MAX - 1);
-			attr = sysfs_open_attribute(path);
-			if (attr) {
-				if (!sysfs_read_attribute(attr)) {
-					p = get_attribute_value(attr);
-				}
-			}
-		}
-	}
+	snprintf(name, sizeof(name), "device/%s", field);
+	p = class_attr_read("dmi", "id", name, 0, val, sizeof(val));
+	if (p == NULL)
+		p = class_attr_read("dmi", "id", field, 0, val, sizeof(val));
 
-	if (p != NULL) {
-		if (buffer && len_buf > 0) {
-			memset(buffer, 0, len_buf);
-			strncpy(buffer, p, len_buf);
-			buf = buffer;
-		} else {
-			buf = strdup(p);
-		}
-	}
+	return attr_copy(p, buffer, len_buf);
+}
 
-	if (attr)
-		sysfs_close_attribute(attr);
+/*
+ * get sysfs block entries
+ *
+ * returns value of entry or NULL if not found
+ */
 
-	sysfs_close_class(cls);
-	return buf;
+char *get_block_data(const char *blk_dev, const char *field, char *buffer, size_t len_buf)
+{
+	char val[CLASS_ATTR_MAX];
+
+	return attr_copy(class_attr_read("block", blk_dev, field, 1, val, sizeof(val)),
+			 buffer, len_buf);
 }
 
 /*
@@ -245,49 +351,17 @@ char *get_block_data(const char *blk_dev, const char *field, char *buffer, size_
 
 char *get_block_partition_data(const char *blk_dev, int part_num, const char *field, char *buffer, size_t len_buf)
 {
-	char                      *buf = NULL;
-	struct sysfs_class        *cls = NULL;
-	struct sysfs_class_device *clsdev = NULL;
-	struct sysfs_attribute    *attr = NULL;
-	char                      *p = NULL;
-	char                       path[SYSFS_PATH_MAX];
-
-	cls = sysfs_open_class("block");
-	if (cls == NULL)
-		return NULL;
-
-	clsdev = sysfs_get_class_device(cls, blk_dev);
-	if (clsdev != NULL) {
-		memset(path, 0, SYSFS_PATH_MAX);
-		strncpy(path, clsdev->path, SYSFS_PATH_MAX);
-		snprintf(path + (uintptr_t)strlen(path), SYSFS_PATH_MAX - strlen(path) - 1, "/%s%d/%s", blk_dev, part_num, field);
-		attr = sysfs_open_attribute(path);
-		if (!attr) {
-			snprintf(path + (uintptr_t)strlen(path), SYSFS_PATH_MAX - strlen(path) - 1, "/%sp%d/%s", blk_dev, part_num, field);
-			attr = sysfs_open_attribute(path);
-		}
-		if (attr) {
-			if (!sysfs_read_attribute(attr)) {
-				p = get_attribute_value(attr);
-			}
-		}
-	}
-
-	if (p != NULL) {
-		if (buffer && len_buf > 0) {
-			memset(buffer, 0, len_buf);
-			strncpy(buffer, p, len_buf);
-			buf = buffer;
-		} else {
-			buf = strdup(p);
-		}
+	char val[CLASS_ATTR_MAX], name[SYSFS_PATH_MAX];
+	char *p;
+
+	snprintf(name, sizeof(name), "%s%d/%s", blk_dev, part_num, field);
+	p = class_attr_read("block", blk_dev, name, 0, val, sizeof(val));
+	if (p == NULL) {
+		snprintf(name, sizeof(name), "%sp%d/%s", blk_dev, part_num, field);
+		p = class_attr_read("block", blk_dev, name, 0, val, sizeof(val));
 	}
 
-	if (attr)
-		sysfs_close_attribute(attr);
-
-	sysfs_close_class(cls);
-	return buf;
+	return attr_copy(p, buffer, len_buf);
 }
 
 /*
@@ -331,6 +405,33 @@ char *get_sysfs_entry(char *buffer, size_t len_buf, const char *format, ...)
 	return ret;
 }
 
+/*
+ * read the sysfs attribute path with openat(), like get_sysfs_entry() but
+ * attributes below /sys/class/<class>/<device> share the directory cache
+ *
+ * returns value of entry or NULL if not found
+ */
+
+char *get_sysfs_attr(const char *path, char *buffer, size_t len_buf)
+{
+	char val[CLASS_ATTR_MAX], cls[SYSFS_PATH_MAX], *dev, *name;
+
+	if (strncmp(path, "/sys/class/", 11) == 0 &&
+	    strlen(path + 11) < sizeof(cls)) {
+		strcpy(cls, path + 11);
+		dev = strchr(cls, '/');
+		name = dev ? strchr(dev + 1, '/') : NULL;
+		if (name != NULL && name[1] != '\0') {
+			*dev++ = '\0';
+			*name++ = '\0';
+			return attr_copy(class_attr_read(cls, dev, name, 0, val, sizeof(val)),
+					 buffer, len_buf);
+		}
+	}
+
+	return attr_copy(attr_read_at(AT_FDCWD, path, val, sizeof(val)), buffer, len_buf);
+}
+
 /*
  * wrapper function for get_block_data function to use printf style parameter
  */
@@ -19,6 +19,14 @@
 static void usage(void)
 {
 	printf("init-systool [-f <pci vendor>] [-d <dmi field>] [-s <sysfs path>] [-b <blockdev> -e <entry> [-p <partnum>]\n");
+	printf("init-systool -q [-j] [<query> ...]\n");
+	printf("  queries (read from stdin, one per line, if none are given):\n");
+	printf("    dmi:<field>  block:<blockdev>:<entry>  part:<blockdev>:<partnum>:<entry>\n");
+	printf("    sysfs:<path>  pci:<vendor>\n");
+	printf("  prints <query>=<value> per query, the value is empty if not found,\n");
+	printf("  pci queries give 1 or 0. With -j a JSON object is printed instead.\n");
+	printf("  In <query>=<value> lines \\ is written as \\\\, = as \\=, a newline as \\n\n");
+	printf("  and other control characters as \\xNN.\n");
 }
 
 static struct option prog_options[] =
@@ -29,6 +37,8 @@ static struct option prog_options[] =
 	{ "entry"      ,1, 0, 'e'},
 	{ "partnum"    ,1, 0, 'p'},
 	{ "sysfs-path" ,1, 0, 's'},
+	{ "query"      ,0, 0, 'q'},
+	{ "json"       ,0, 0, 'j'},
 	{ "help"       ,0, 0, 'h'},
 	{ NULL         ,0, 0,  0 }
 };
@@ -46,16 +56,146 @@ static void free_list(struct vendor_list *list)
 	} while (list);
 }
 
+/*
+ * answer one query of the batch mode, returns the value or NULL if there
+ * is none
+ */
+
+static char *batch_query(char *query, char *buffer, size_t len_buf)
+{
+	struct vendor_list vendor;
+	char *arg, *dev, *part, *entry;
+
+	arg = strchr(query, ':');
+	if (!arg)
+		return NULL;
+	*arg++ = '\0';
+
+	if (strcmp(query, "dmi") == 0)
+		return get_dmi_data(arg, buffer, len_buf);
+
+	if (strcmp(query, "sysfs") == 0)
+		return get_sysfs_attr(arg, buffer, len_buf);
+
+	if (strcmp(query, "pci") == 0) {
+		memset(&vendor, 0, sizeof(vendor));
+		strncpy(vendor.name, arg, sizeof(vendor.name) - 1);
+		snprintf(buffer, len_buf, "%d", find_pci_vendors(&vendor));
+		return buffer;
+	}
+
+	if (strcmp(query, "block") == 0) {
+		dev = arg;
+		entry = strchr(dev, ':');
+		if (!entry)
+			return NULL;
+		*entry++ = '\0';
+		return get_block_data(dev, entry, buffer, len_buf);
+	}
+
+	if (strcmp(query, "part") == 0) {
+		dev = arg;
+		part = strchr(dev, ':');
+		if (!part)
+			return NULL;
+		*part++ = '\0';
+		entry = strchr(part, ':');
+		if (!entry)
+			return NULL;
+		*entry++ = '\0';
+		return get_block_partition_data(dev, atoi(part), entry, buffer, len_buf);
+	}
+
+	return NULL;
+}
+
+/*
+ * print s, escaped for JSON or for a key=value line
+ */
+
+static void print_escaped(const char *s, int json)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || (json && *s == '"'))
+			printf("\\%c", *s);
+		else if (*s == '\n')
+			printf("\\n");
+		else if (!json && *s == '=')
+			printf("\\=");
+		else if ((unsigned char) *s < ' ')
+			printf(json ? "\\u%04x" : "\\x%02x", (unsigned char) *s);
+		else
+			putchar(*s);
+	}
+}
+
+static void batch_answer(const char *query, int json, int *count)
+{
+	char buffer[4096], *q, *p;
+
+	q = strdup(query);
+	if (!q)
+		return;
+	p = batch_query(q, buffer, sizeof(buffer));
+
+	if (json) {
+		printf("%s\n  \"", (*count)++ ? "," : "{");
+		print_escaped(query, 1);
+		if (!p) {
+			printf("\": null");
+		} else {
+			printf("\": \"");
+			print_escaped(p, 1);
+			printf("\"");
+		}
+	} else {
+		print_escaped(query, 0);
+		putchar('=');
+		if (p)
+			print_escaped(p, 0);
+		putchar('\n');
+	}
+
+	free(q);
+}
+
+/*
+ * batch mode: answer all queries in one process, the sysfs directories
+ * and the hardware inventory are read only once
+ */
+
+static int batch_mode(int argc, char **argv, int json)
+{
+	char line[PATH_MAX];
+	int i, count = 0;
+
+	if (argc > 0) {
+		for (i = 0; i < argc; i++)
+			batch_answer(argv[i], json, &count);
+	} else {
+		while (fgets(line, sizeof(line), stdin)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0' || line[0] == '#')
+				continue;
+			batch_answer(line, json, &count);
+		}
+	}
+
+	if (json)
+		printf("%s}\n", count ? "\n" : "{");
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
-	int i, option_index = 0;
+	int i, option_index = 0, batch = 0, json = 0;
 	char *dmi = NULL, *blkdev = NULL, *entry = NULL, *partnum = NULL, *syspath = NULL;
 	char buffer[255], *p;
 	struct vendor_list *pci_vendor = NULL, *l = NULL;
 
 	/* get options */
-	while ((i = getopt_long(argc, argv, "hf:d:b:e:p:s:", prog_options,
+	while ((i = getopt_long(argc, argv, "hqjf:d:b:e:p:s:", prog_options,
 		&option_index)) != -1) {
 		switch(i) {
 			case 'f':
@@ -73,6 +213,7 @@ int main(int argc, char **argv)
 					}
 					l = l->next;
 				}
+				l->next = NULL;
 				strncpy(l->name, optarg, 8);
 				break;
 			case 'd':
@@ -90,6 +231,12 @@ int main(int argc, char **argv)
 			case 's':
 				syspath = optarg;
 				break;
+			case 'q':
+				batch = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
 			case 'h':
 				usage();
 				return(0);
@@ -101,6 +248,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (batch) {
+		free_list(pci_vendor);
+		return batch_mode(argc - optind, argv + optind, json);
+	}
+
 	if (syspath) {
 		p = get_sysfs_entry(buffer, 255, "%s", syspath);
 		if (!p) {
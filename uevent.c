@@ -0,0 +1,278 @@
+/*
+ * initramfs init program.
+ * load drivers for hardware showing up late, driven by kernel uevents.
+
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "init.h"
+
+#define UEVENT_BUFFER_SIZE	8192
+#define UEVENT_RCVBUF		(4 * 1024 * 1024)
+#define UEVENT_MAX_ALIASES	256	/* modaliases loaded in one batch */
+
+static int uevent_fd = -1;
+
+/* open the kernel uevent socket, the kernel queues all events from now on
+ * until they are read by uevent_wait(), returns 0 on success */
+
+int
+uevent_open (init_t *init)
+{
+	struct sockaddr_nl addr;
+	int size = UEVENT_RCVBUF;
+
+	if (uevent_fd >= 0)
+		return 0;
+
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			   NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0) {
+		msg(init,LOG_ERR,"uevent: can not open netlink socket (errno %d)\n", errno);
+		return -1;
+	}
+
+	/* coldplugging creates a burst of events, do not lose them */
+	if (setsockopt(uevent_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+		setsockopt(uevent_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = 1;	/* kernel events */
+
+	if (bind(uevent_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		msg(init,LOG_ERR,"uevent: can not bind netlink socket (errno %d)\n", errno);
+		close(uevent_fd);
+		uevent_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+uevent_close (void)
+{
+	if (uevent_fd >= 0)
+		close(uevent_fd);
+	uevent_fd = -1;
+}
+
+int
+uevent_active (void)
+{
+	return (uevent_fd >= 0);
+}
+
+static long uevent_now_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* remember the disk of a block device event, partitions count for the
+ * disk they are on */
+
+static void uevent_add_disk (struct uevent_disks *disks, const char *devpath,
+			     const char *devtype)
+{
+	const char *name, *end;
+	size_t len;
+	int i;
+
+	end = devpath + strlen(devpath);
+	if (devtype != NULL && strcmp(devtype, "partition") == 0) {
+		while (end > devpath && end[-1] != '/')
+			end--;
+		if (end > devpath)
+			end--;
+	}
+	name = end;
+	while (name > devpath && name[-1] != '/')
+		name--;
+
+	len = end - name;
+	if (len == 0 || len >= sizeof(disks->name[0]))
+		return;
+
+	for (i = 0; i < disks->count; i++) {
+		if (strncmp(disks->name[i], name, len) == 0 && disks->name[i][len] == '\0')
+			return;
+	}
+	if (disks->count == UEVENT_MAX_DISKS) {
+		disks->all = 1;
+		return;
+	}
+	memcpy(disks->name[disks->count], name, len);
+	disks->name[disks->count][len] = '\0';
+	disks->count++;
+}
+
+/* read all queued events, collect the modaliases of "add" events and the
+ * disks of added or changed block devices, returns -1 if events were lost */
+
+static int uevent_drain (char **aliases, int *count, struct uevent_disks *disks)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	struct sockaddr_nl addr;
+	struct iovec iov;
+	struct msghdr hdr;
+	const char *action, *subsystem, *modalias, *devpath, *devtype;
+	char *p, *end;
+	ssize_t len;
+	int ret = 0;
+
+	/* a full batch leaves the rest queued for the next round */
+	while (*count < UEVENT_MAX_ALIASES) {
+		memset(&hdr, 0, sizeof(hdr));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf) - 1;
+		hdr.msg_name = &addr;
+		hdr.msg_namelen = sizeof(addr);
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+
+		len = recvmsg(uevent_fd, &hdr, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+				ret = -1;	/* receive queue overflow */
+			break;
+		}
+		if (len == 0)
+			break;
+
+		/* only trust messages from the kernel */
+		if (addr.nl_pid != 0)
+			continue;
+
+		buf[len] = '\0';
+		end = buf + len;
+		action = subsystem = modalias = devpath = devtype = NULL;
+
+		/* "action@devpath" followed by KEY=value strings */
+		for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+			if (strncmp(p, "ACTION=", 7) == 0)
+				action = p + 7;
+			else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+				subsystem = p + 10;
+			else if (strncmp(p, "MODALIAS=", 9) == 0)
+				modalias = p + 9;
+			else if (strncmp(p, "DEVPATH=", 8) == 0)
+				devpath = p + 8;
+			else if (strncmp(p, "DEVTYPE=", 8) == 0)
+				devtype = p + 8;
+		}
+
+		if (action == NULL)
+			continue;
+
+		/* partitions appearing or a new partition table */
+		if (subsystem != NULL && strcmp(subsystem, "block") == 0 && devpath != NULL &&
+		    (strcmp(action, "add") == 0 || strcmp(action, "change") == 0))
+			uevent_add_disk(disks, devpath, devtype);
+
+		if (strcmp(action, "add") != 0)
+			continue;
+
+		if (modalias != NULL) {
+			aliases[*count] = strdup(modalias);
+			if (aliases[*count] != NULL)
+				(*count)++;
+		}
+	}
+
+	return ret;
+}
+
+/* wait up to timeout_ms for uevents and load the modules for devices
+ * added in the meantime. Returns early with 1 as soon as block devices
+ * were added or changed, their disks are listed in disks (disks->all is
+ * set if all disks have to be checked). Returns 0 on timeout and -1 if
+ * there is no uevent socket. */
+
+int
+uevent_wait (init_t *init, int timeout_ms, struct uevent_disks *disks)
+{
+	struct pollfd pfd;
+	char *aliases[UEVENT_MAX_ALIASES];
+	const char *origin;
+	long deadline, remaining;
+	int count, i, ret, block_added = 0;
+
+	disks->count = 0;
+	disks->all = 0;
+
+	if (uevent_fd < 0)
+		return -1;
+
+	deadline = uevent_now_ms() + timeout_ms;
+
+	for (;;) {
+		remaining = deadline - uevent_now_ms();
+		if (remaining < 0)
+			remaining = 0;
+
+		pfd.fd = uevent_fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, remaining);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		count = 0;
+		ret = uevent_drain(aliases, &count, disks);
+		origin = modtrace_push("uevent");
+
+		if (count > 0) {
+			msg(init,LOG_INFO," * loading modules for %d new devices (via uevent)\n", count);
+			load_modalias_modules(init, aliases, count);
+			for (i = 0; i < count; i++)
+				free(aliases[i]);
+		}
+
+		if (ret < 0) {
+			/* events were lost, fall back to a full rescan */
+			msg(init,LOG_NOTICE," * looking for devices (via module alias)\n");
+			load_alias_modules(init, "all");
+			disks->all = 1;
+		}
+		modtrace_pop(origin);
+
+		if (disks->count > 0 || disks->all)
+			block_added = 1;
+
+		if (block_added)
+			break;
+	}
+
+	return block_added;
+}